@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_JNICONTEXT_H
+#define ICMPENGUIN_JNICONTEXT_H
+
+#import <deque>
+#import <mutex>
+#import <string>
+#import <unordered_map>
+#import <vector>
+#import <jni.h>
+
+#define OFFENDER_CACHE_SIZE 64
+
+// Offender addresses as global ref strings. A trace keeps hearing from the same few routers,
+// so results share one Java string per address. The oldest entry makes room for a new one.
+// Only used by the delivery thread.
+class OffenderCache {
+private:
+    std::unordered_map<std::string, jstring> strings;
+    std::deque<std::string> order;
+
+public:
+    // The string stays valid until evicted, callers must not delete it
+    jstring get(JNIEnv *env, const std::string &offender) {
+        auto it = strings.find(offender);
+        if (it != strings.end())
+            return it->second;
+        if (strings.size() >= OFFENDER_CACHE_SIZE) {
+            auto oldest = strings.find(order.front());
+            env->DeleteGlobalRef(oldest->second);
+            strings.erase(oldest);
+            order.pop_front();
+        }
+        auto local = env->NewStringUTF(offender.c_str());
+        if (local == nullptr)
+            return nullptr;
+        auto global = reinterpret_cast<jstring>(env->NewGlobalRef(local));
+        env->DeleteLocalRef(local);
+        strings.emplace(offender, global);
+        order.push_back(offender);
+        return global;
+    }
+
+    void clear(JNIEnv *env) {
+        for (auto &entry: strings)
+            env->DeleteGlobalRef(entry.second);
+        strings.clear();
+        order.clear();
+    }
+};
+
+// What the callbacks of one manager need on the Java side, created along with the manager
+struct JniCallbackContext {
+    // The Kotlin ProbeManager
+    jobject manager;
+    OffenderCache offenders;
+    // Target addresses as the Kotlin side passed them, indexed by target id
+    std::vector<jstring> targets;
+    std::mutex targets_mutex;
+
+    void add_target(JNIEnv *env, int id, jstring ip) {
+        std::lock_guard<std::mutex> lock(targets_mutex);
+        if (id >= static_cast<int>(targets.size()))
+            targets.resize(id + 1, nullptr);
+        targets[id] = reinterpret_cast<jstring>(env->NewGlobalRef(ip));
+    }
+
+    jstring target(int id) {
+        std::lock_guard<std::mutex> lock(targets_mutex);
+        if (id < 0 || id >= static_cast<int>(targets.size()) || targets[id] == nullptr)
+            return targets[0];
+        return targets[id];
+    }
+
+    void release(JNIEnv *env) {
+        offenders.clear(env);
+        for (auto ip: targets) {
+            if (ip != nullptr)
+                env->DeleteGlobalRef(ip);
+        }
+        env->DeleteGlobalRef(manager);
+    }
+};
+
+#endif //ICMPENGUIN_JNICONTEXT_H
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_MPSCQUEUE_H
+#define ICMPENGUIN_MPSCQUEUE_H
+
+#import <atomic>
+#import <cstddef>
+#import <cstdint>
+#import <memory>
+
+#define CACHE_LINE_SIZE 64
+
+// Bounded lock-free queue for many producers and a single consumer (Vyukov's ring).
+// Each cell carries a sequence number telling whether it is free for the producer
+// of that lap or published for the consumer.
+template<typename T>
+class MpscQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos{0};
+    // Only touched by the consumer
+    alignas(CACHE_LINE_SIZE) size_t dequeue_pos = 0;
+
+public:
+    // Capacity must be a power of two
+    explicit MpscQueue(size_t capacity) : cells(std::make_unique<Cell[]>(capacity)), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Returns false when the queue is full
+    bool push(T &&value) {
+        Cell *cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. A cell claimed by a producer but not yet published reads as empty,
+    // the producer wakes the consumer after publishing.
+    bool pop(T &value) {
+        Cell *cell = &cells[dequeue_pos & mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        if (sequence != dequeue_pos + 1)
+            return false;
+        value = std::move(cell->data);
+        cell->data = T();
+        cell->sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+        dequeue_pos++;
+        return true;
+    }
+
+    // Consumer only
+    bool empty() const {
+        return cells[dequeue_pos & mask].sequence.load(std::memory_order_acquire) != dequeue_pos + 1;
+    }
+};
+
+#endif //ICMPENGUIN_MPSCQUEUE_H
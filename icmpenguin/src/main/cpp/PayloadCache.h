@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_PAYLOADCACHE_H
+#define ICMPENGUIN_PAYLOADCACHE_H
+
+#import <cstdint>
+#import <deque>
+#import <memory>
+#import <vector>
+
+#define PAYLOAD_CACHE_SIZE 16
+
+using ProbePattern = std::shared_ptr<const std::vector<char>>;
+// Packet bytes following the ICMP header, never modified once built
+using PacketPayload = std::shared_ptr<const std::vector<uint8_t>>;
+
+// Payloads already filled with a pattern, keyed by size and pattern. Probes of a ping or a trace
+// all look the same past the header, so they share one buffer instead of filling their own.
+// The oldest entry makes room for a new one. Only used by the worker.
+class PayloadCache {
+private:
+    struct Entry {
+        size_t size;
+        ProbePattern pattern;
+        PacketPayload payload;
+    };
+
+    std::deque<Entry> entries;
+
+    static PacketPayload build(size_t size, const std::vector<char> &pattern) {
+        auto payload = std::make_shared<std::vector<uint8_t>>(size, 0);
+        if (!pattern.empty()) {
+            for (size_t i = 0; i < size; i++)
+                (*payload)[i] = static_cast<uint8_t>(pattern[i % pattern.size()]);
+        }
+        return payload;
+    }
+
+public:
+    PacketPayload get(size_t size, const ProbePattern &pattern) {
+        for (auto &entry: entries) {
+            if (entry.size != size)
+                continue;
+            // Probes of one batch share the pattern object, separate calls only its contents
+            if (entry.pattern == pattern)
+                return entry.payload;
+            if (*entry.pattern == *pattern) {
+                entry.pattern = pattern;
+                return entry.payload;
+            }
+        }
+        if (entries.size() >= PAYLOAD_CACHE_SIZE)
+            entries.pop_front();
+        entries.push_back({.size = size, .pattern = pattern, .payload = build(size, *pattern)});
+        return entries.back().payload;
+    }
+};
+
+#endif //ICMPENGUIN_PAYLOADCACHE_H
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "Poller.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <android/log_macros.h>
+
+Poller::~Poller() {
+    if (timer_fd >= 0)
+        close(timer_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+bool Poller::init() {
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        ALOGE("Error creating epoll: %d %s", errno, strerror(errno));
+        return false;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        ALOGE("Error creating timer: %d %s", errno, strerror(errno));
+        return false;
+    }
+    add(timer_fd);
+    return true;
+}
+
+void Poller::add(int fd) {
+    epoll_event event{
+            .events = EPOLLIN,
+            .data = {.fd = fd}
+    };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void Poller::remove(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Poller::wait(int *fds, int max_fds, int64_t timeout_ns) {
+    int timeout_ms = timeout_ns < 0 ? -1 : 0;
+    if (timeout_ns > 0) {
+        // Re-arming also resets the expiration count left by an earlier wait
+        itimerspec spec{
+                .it_value = {
+                        .tv_sec = static_cast<time_t>(timeout_ns / 1000000000LL),
+                        .tv_nsec = static_cast<long>(timeout_ns % 1000000000LL),
+                },
+        };
+        if (timerfd_settime(timer_fd, 0, &spec, nullptr) == 0) {
+            timeout_ms = -1;
+        } else {
+            ALOGE("Error arming timer: %d %s", errno, strerror(errno));
+            timeout_ms = static_cast<int>((timeout_ns + 999999) / 1000000);
+        }
+    }
+    epoll_event events[POLLER_MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, std::min(max_fds, POLLER_MAX_EVENTS), timeout_ms);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.fd == timer_fd) {
+            // The timer only ends the wait, drain it so it does not stay readable
+            uint64_t expirations;
+            read(timer_fd, &expirations, sizeof(expirations));
+            continue;
+        }
+        fds[count++] = events[i].data.fd;
+    }
+    return count;
+}
+
+std::unique_ptr<Poller> create_poller() {
+    auto poller = std::make_unique<Poller>();
+    if (poller->init())
+        return poller;
+    return nullptr;
+}
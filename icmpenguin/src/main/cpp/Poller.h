@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_POLLER_H
+#define ICMPENGUIN_POLLER_H
+
+#import <cstdint>
+#import <memory>
+
+#define POLLER_MAX_EVENTS 32
+
+// Readiness notification for the worker loop. Only the worker adds and removes sockets
+// and waits, Reactor::notify() merely writes the wakeup eventfd.
+// epoll_wait only takes milliseconds, sub-millisecond timeouts go through a timerfd in the
+// same set. epoll_pwait2 would do it directly but app seccomp policies predating it kill the caller.
+class Poller {
+private:
+    int epoll_fd = -1;
+    int timer_fd = -1;
+
+public:
+    ~Poller();
+
+    bool init();
+
+    void add(int fd);
+
+    void remove(int fd);
+
+    // Fills fds with up to max_fds readable descriptors, a negative timeout_ns waits forever
+    int wait(int *fds, int max_fds, int64_t timeout_ns);
+};
+
+// nullptr when epoll could not be set up
+std::unique_ptr<Poller> create_poller();
+
+#endif //ICMPENGUIN_POLLER_H
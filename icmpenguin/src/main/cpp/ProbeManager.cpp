@@ -18,29 +18,36 @@
 #include "ProbeManager.h"
 
 #include <utility>
+#include <algorithm>
+#include <ctime>
 #include <random>
 #include <arpa/inet.h>
-#include <sys/epoll.h>
-#include <sys/eventfd.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <linux/ip.h>
 #include <linux/icmp.h>
 #include <linux/icmpv6.h>
 #include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <android/log_macros.h>
 #include <unistd.h>
+#include <zlib.h>
 #include <jni.h>
 #include "jni_methods.h"
+#include "JniContext.h"
 
-ProbeManager::ProbeManager(const char *remote_ip, const char *source_ip, void *callback_obj,
-                           JNICallback trigger_callback) {
-    this->remote_ip = std::string(remote_ip);
-    if (try_init_addr(AF_INET, remote_ip, remote_addr) <= 0) {
-        if (try_init_addr(AF_INET6, remote_ip, remote_addr) <= 0) {
-            ALOGE("Invalid network address format");
-            return;
-        }
-    }
+ProbeManager::ProbeManager(const char *remote_ip, const char *source_ip, const ManagerOptions &options,
+                           void *callback_obj, JNICallback trigger_callback,
+                           JNIResultsCallback trigger_results, JNIIdleCallback trigger_idle,
+                           JNISessionEndCallback trigger_session_end, JNIReleasedCallback trigger_released) {
+    this->use_shared_sockets = options.shared_sockets;
+    this->use_kernel_timestamps = options.kernel_timestamps;
+    this->payload_mode = options.payload_mode;
+    this->payload_limit = options.payload_limit;
+    this->backpressure = options.backpressure;
+    this->delivery_threshold = std::max(options.delivery_threshold, static_cast<size_t>(1));
+    // Checked by start(), the rest is set up either way so the manager can be freed as usual
+    register_target(remote_ip);
     this->source_ip = std::string(source_ip);
     if (!this->source_ip.empty()) {
         if (try_init_addr(AF_INET, source_ip, source_addr) <= 0) {
@@ -53,10 +60,46 @@ ProbeManager::ProbeManager(const char *remote_ip, const char *source_ip, void *c
     }
     this->callback_obj = callback_obj;
     this->trigger_callback = std::move(trigger_callback);
+    this->trigger_results = std::move(trigger_results);
+    this->trigger_idle = std::move(trigger_idle);
+    this->trigger_session_end = std::move(trigger_session_end);
+    this->trigger_released = std::move(trigger_released);
+    if (options.result_ring && this->trigger_results != nullptr)
+        result_ring = std::make_unique<ResultRing>();
+    receive_batch.init(RECEIVE_BATCH_SIZE, INCOMING_BUFFER_SIZE, RECEIVE_CONTROL_SIZE);
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(0, 0xffff);
     ident = dis(gen);
+    init_echo_headers();
+    register_pattern(nullptr, 0);
+}
+
+int64_t ProbeManager::timespec_to_ns(const struct timespec &ts) {
+    return static_cast<int64_t>(ts.tv_sec) * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+int64_t ProbeManager::monotonic_ns() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_ns(ts);
+}
+
+ClockSample ProbeManager::sample_clocks() {
+    struct timespec realtime{};
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    return {
+            .monotonic_ns = monotonic_ns(),
+            .realtime_ns = timespec_to_ns(realtime),
+    };
+}
+
+int64_t ProbeManager::kernel_stamp_to_monotonic(const struct timespec &stamp, const ClockSample &now,
+                                                int64_t sent_ns) {
+    // Kernel stamps are wall clock, only their age is trusted. A wall clock step between
+    // the packet arriving and this read could still push the result out of range.
+    int64_t received_ns = now.monotonic_ns - (now.realtime_ns - timespec_to_ns(stamp));
+    return std::clamp(received_ns, sent_ns, now.monotonic_ns);
 }
 
 int ProbeManager::try_init_addr(int family, const char *addr, sockaddr_storage &addr_storage) {
@@ -74,134 +117,181 @@ int ProbeManager::try_init_addr(int family, const char *addr, sockaddr_storage &
     return inet_pton(family, addr, sin_addr_ptr);
 }
 
-void ProbeManager::start() {
-    worker = std::thread(&ProbeManager::handler, this);
-    std::future<void> start_future = start_promise.get_future();
-    try {
-        auto start_result = start_future.wait_for(std::chrono::seconds(10));
-
-        if (start_result == std::future_status::timeout) {
-            ALOGE("Failed to start probe manager (timeout)");
-            return;
-        }
-    } catch (const std::exception &e) {
-        ALOGE("Failed to start probe manager: %s", e.what());
+bool ProbeManager::start() {
+    if (find_target(PRIMARY_TARGET) == nullptr) {
+        ALOGE("Invalid remote address");
+        return false;
+    }
+    auto *shared = Reactor::get();
+    if (!shared->attach(this)) {
+        ALOGE("Failed to start probe manager");
+        return false;
     }
+    reactor = shared;
+    running.store(true);
+    return true;
 }
 
 void ProbeManager::stop() {
-    running.store(false);
-    wakeup_event();
-    worker.join();
+    if (!running.exchange(false))
+        return;
+    wait_submissions();
+    reactor->detach(this);
 }
 
-// Worker thread
-void ProbeManager::handler() {
-    setup_epoll();
-    if (epoll_fd < 0 || wakeup_fd < 0) {
-        ALOGE("Error setting up epoll");
-        start_promise.set_exception(std::make_exception_ptr(std::runtime_error("Error setting up epoll")));
+void ProbeManager::dispose(std::function<void()> release) {
+    if (reactor == nullptr || !reactor->on_delivery_thread()) {
+        stop();
+        release();
         return;
     }
-    running.store(true);
-    start_promise.set_value();
-    while (running.load()) {
-        epoll_event events[32];
-        int n = epoll_wait(epoll_fd, events, 32, get_min_wait_time());
-        for (int i = 0; i < n; i++) {
-            if (events[i].data.fd == wakeup_fd) {
-                // Handle wakeup event
-                uint64_t ev;
-                read(wakeup_fd, &ev, sizeof(ev));
-                continue;
-            }
-            // Handle socket events
-            read_data(events[i].data.fd);
-        }
-        check_timeouts();
-        send_callbacks();
-        clean_probes();
+    // Waiting here from a callback of this manager would never return, one of another manager
+    // would keep a delivery thread from the rest
+    if (running.exchange(false)) {
+        wait_submissions();
+        reactor->detach_later(this, std::move(release));
+        return;
     }
-    force_timeouts();
+    release();
+}
+
+bool ProbeManager::begin_submission() {
+    submitting.fetch_add(1);
+    // Pairs with stop(), either the sender sees it stopped or stop() waits for the sender
+    if (running.load())
+        return true;
+    end_submission();
+    return false;
+}
+
+void ProbeManager::end_submission() {
+    // Only a stop waiting for the last sender needs the wakeup
+    if (submitting.fetch_sub(1) == 1 && !running.load()) {
+        std::lock_guard lock(submitting_mutex);
+        submissions_done.notify_all();
+    }
+}
+
+void ProbeManager::wait_submissions() {
+    // Senders that saw the manager running hand their submissions over first, shutdown rejects them
+    std::unique_lock lock(submitting_mutex);
+    submissions_done.wait(lock, [this] { return submitting.load() == 0; });
+}
+
+void ProbeManager::rollback_queued(int count) {
+    // Idle is only signalled by the worker, it checks the count again before doing so
+    if (queued.fetch_sub(count) == count) {
+        idle_requested.store(true);
+        notify_worker();
+    }
+}
+
+void ProbeManager::notify_worker() {
+    reactor->notify();
+}
+
+void ProbeManager::check_idle_request() {
+    if (idle_requested.exchange(false) && queued.load() == 0)
+        idle_reached = true;
+}
+
+// Worker thread
+void ProbeManager::begin_pass() {
+    // Held back until its callbacks catch up, the other managers keep going
+    if (!delivery_held.load())
+        process_submissions();
+    check_idle_request();
+    // Before parking, the worker may not wake up for a while
+    if (std::exchange(idle_reached, false))
+        signal_idle();
+}
+
+void ProbeManager::end_pass() {
+    check_timeouts();
+    enqueue_completions();
     clean_probes();
-    close(wakeup_fd);
-    close(epoll_fd);
+    cancel_pending();
 }
 
-void ProbeManager::setup_epoll() {
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        ALOGE("Error creating epoll: %d %s", errno, strerror(errno));
-        return;
+void ProbeManager::shutdown() {
+    force_timeouts();
+    // Not reported, nobody waits for them anymore
+    release_queued(static_cast<int>(completed_probes.size()));
+    clean_probes();
+    for (auto &session: sessions) {
+        finish_ping_session(session);
+        report_session_end({.id = session.request.id, .span = 1, .stats = session.stats});
     }
-    wakeup_fd = eventfd(0, EFD_NONBLOCK);
-    if (wakeup_fd < 0) {
-        ALOGE("Error creating wakeup fd: %d %s", errno, strerror(errno));
-        return;
+    sessions.clear();
+    for (auto &trace: traces) {
+        finish_trace_session(trace);
+        report_session_end({.id = trace.request.id, .span = trace.plan->max_hops});
     }
-    epoll_event event{
-            .events = EPOLLIN | EPOLLRDHUP,
-            .data = {.fd = wakeup_fd}
-    };
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event);
+    traces.clear();
+    reject_submissions();
+    check_idle_request();
+    if (std::exchange(idle_reached, false))
+        signal_idle();
+    close_shared_sockets();
 }
 
-void ProbeManager::wakeup_event() const {
-    int64_t one = 1;
-    write(wakeup_fd, &one, sizeof(one));
+void ProbeManager::init_echo_headers() {
+    auto hdr = reinterpret_cast<struct icmphdr *>(echo_headers[family_index(AF_INET)].data());
+    hdr->type = ICMP_ECHO;
+    hdr->code = 0;
+    hdr->un.echo.id = htons(ident);
+    auto hdr6 = reinterpret_cast<struct icmp6hdr *>(echo_headers[family_index(AF_INET6)].data());
+    hdr6->icmp6_type = ICMPV6_ECHO_REQUEST;
+    hdr6->icmp6_code = 0;
+    hdr6->icmp6_dataun.u_echo.identifier = htons(ident);
 }
 
-void ProbeManager::init_packet_data(ProbeContext &probe, int size, char *pattern, int pattern_len) const {
-    int data_offset = probe.probe_type == ProbeType::ICMP ? ICMP_HEADER_SIZE : 0;
-    int packet_size = size;
-    if (probe.probe_type == ProbeType::ICMP && size < ICMP_HEADER_SIZE)
-        packet_size = ICMP_HEADER_SIZE;
-    probe.packet_data.resize(packet_size);
-    memset(probe.packet_data.data(), 0, packet_size);
+void ProbeManager::init_packet_data(ProbeContext &probe, ProbeDetails &details, int size,
+                                    const ProbePattern &pattern) {
+    details.header_len = 0;
     if (probe.probe_type == ProbeType::ICMP) {
-        if (remote_addr.ss_family == AF_INET) {
-            auto hdr = reinterpret_cast<struct icmphdr *>(probe.packet_data.data());
-            hdr->type = ICMP_ECHO;
-            hdr->code = 0;
-            hdr->un.echo.id = htons(ident);
-            hdr->un.echo.sequence = htons(probe.sequence);
-        } else {
-            auto hdr = reinterpret_cast<struct icmp6hdr *>(probe.packet_data.data());
-            hdr->icmp6_type = ICMPV6_ECHO_REQUEST;
-            hdr->icmp6_code = 0;
-            hdr->icmp6_dataun.u_echo.identifier = htons(ident);
-            hdr->icmp6_dataun.u_echo.sequence = htons(probe.sequence);
-        }
-    }
-    // Fill packet with pattern
-    if (pattern_len > 0) {
-        for (int i = data_offset; i < packet_size; i += pattern_len) {
-            int chunk_size = packet_size - i;
-            if (chunk_size > pattern_len)
-                chunk_size = pattern_len;
-            memcpy(probe.packet_data.data() + i, pattern, static_cast<size_t>(chunk_size));
-        }
+        details.header = echo_headers[family_index(probe.family)];
+        uint16_t wire_sequence = htons(probe.wire_sequence);
+        memcpy(details.header.data() + ICMP_SEQUENCE_OFFSET, &wire_sequence, sizeof(wire_sequence));
+        details.header_len = ICMP_HEADER_SIZE;
     }
+    size_t payload_size = static_cast<size_t>(std::max(size, 0));
+    payload_size = payload_size > details.header_len ? payload_size - details.header_len : 0;
+    details.payload = payloads.get(payload_size, pattern);
+    probe.packet_size = details.header_len + payload_size;
+    largest_packet = std::max(largest_packet, probe.packet_size);
+}
+
+int ProbeManager::init_packet_iov(ProbeDetails &details, iovec *iov) {
+    int count = 0;
+    if (details.header_len > 0)
+        iov[count++] = {.iov_base = details.header.data(), .iov_len = details.header_len};
+    if (!details.payload->empty())
+        iov[count++] = {
+                .iov_base = const_cast<uint8_t *>(details.payload->data()),
+                .iov_len = details.payload->size(),
+        };
+    return count;
 }
 
-void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) const {
+void ProbeManager::init_socket(int sock, int family, int ttl, int64_t timeout_ns, bool detect_mtu) {
     // TTL
-    if (probe.ttl > 0) {
-        if (remote_addr.ss_family == AF_INET) {
-            if (setsockopt(sock, IPPROTO_IP, IP_TTL, &probe.ttl, sizeof(probe.ttl)) < 0) {
+    if (ttl > 0) {
+        if (family == AF_INET) {
+            if (setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)) < 0) {
                 ALOGE("Error setting TTL: %d %s", errno, strerror(errno));
             }
         } else {
-            if (setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &probe.ttl, sizeof(probe.ttl)) < 0) {
+            if (setsockopt(sock, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl, sizeof(ttl)) < 0) {
                 ALOGE("Error setting TTL: %d %s", errno, strerror(errno));
             }
         }
     }
     // Receive timeout
-    if (probe.timeout > 0) {
+    if (timeout_ns > 0) {
         timeval tv{
-                .tv_sec = MS_TO_SEC(probe.timeout),
-                .tv_usec = MS_TO_USEC(probe.timeout)
+                .tv_sec = static_cast<time_t>(timeout_ns / NSEC_PER_SEC),
+                .tv_usec = static_cast<suseconds_t>(timeout_ns % NSEC_PER_SEC / NSEC_PER_USEC)
         };
         if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
             ALOGE("Error setting receive timeout: %d %s", errno, strerror(errno));
@@ -219,7 +309,7 @@ void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) c
     }
     // Receive error
     int on = 1;
-    if (remote_addr.ss_family == AF_INET) {
+    if (family == AF_INET) {
         if (setsockopt(sock, SOL_IP, IP_RECVERR, &on, sizeof(on)) < 0) {
             ALOGE("Error setting recverr: %d %s", errno, strerror(errno));
         }
@@ -229,7 +319,7 @@ void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) c
         }
     }
     // Receive TTL
-    if (remote_addr.ss_family == AF_INET) {
+    if (family == AF_INET) {
         if (setsockopt(sock, SOL_IP, IP_RECVTTL, &on, sizeof(on)) < 0) {
             ALOGE("Error setting recvttl: %d %s", errno, strerror(errno));
         }
@@ -240,7 +330,7 @@ void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) c
     }
     // Receive MTU
     if (detect_mtu) {
-        if (remote_addr.ss_family == AF_INET) {
+        if (family == AF_INET) {
             on = IP_PMTUDISC_PROBE;
             if (setsockopt(sock, SOL_IP, IP_MTU_DISCOVER, &on, sizeof(on)) < 0) {
                 ALOGE("Error setting mtu discover: %d %s", errno, strerror(errno));
@@ -254,7 +344,7 @@ void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) c
     }
     {
         int tos = IPTOS_LOWDELAY;
-        if (remote_addr.ss_family == AF_INET) {
+        if (family == AF_INET) {
             if (setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
                 ALOGE("Error setting tos: %d %s", errno, strerror(errno));
             }
@@ -266,182 +356,1392 @@ void ProbeManager::init_socket(int sock, ProbeContext &probe, bool detect_mtu) c
     }
 }
 
-int ProbeManager::send_probe(int id, ProbeType probe_type, int port, int sequence, int ttl, int timeout,
-                             int size, bool detect_mtu, char *pattern, int pattern_len) {
-    ProbeContext probe{
+bool ProbeManager::enable_timestamping(int sock) const {
+    int flags = TIMESTAMPING_FLAGS;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        ALOGE("Error setting timestamping: %d %s", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int ProbeManager::create_socket(int family, int protocol, std::string &error_msg) {
+    // Bound sockets only reach targets of the source address family
+    if (!source_ip.empty() && source_addr.ss_family != family) {
+        error_msg = "Source address family does not match the target";
+        return -1;
+    }
+    int sock = socket(family, SOCK_DGRAM, protocol);
+    if (sock < 0) {
+        error_msg = std::string("Error creating socket: ") + strerror(errno);
+        ALOGE("Error creating socket: %d %s", errno, strerror(errno));
+        return -1;
+    }
+
+    if (!source_ip.empty()) {
+        // Bind to specific source address
+        socklen_t source_addr_len = source_addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+        if (bind(sock, reinterpret_cast<sockaddr *>(&source_addr), source_addr_len) < 0) {
+            error_msg = std::string("Error binding socket: ") + strerror(errno);
+            ALOGE("Error binding socket: %d %s", errno, strerror(errno));
+            close(sock);
+            return -1;
+        }
+    }
+    return sock;
+}
+
+SharedSocket *ProbeManager::get_shared_socket(int family, bool detect_mtu, std::string &error_msg) {
+    auto &shared = shared_sockets[shared_index(family, detect_mtu)];
+    if (shared.fd >= 0)
+        return &shared;
+
+    int protocol = family == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+    int sock = create_socket(family, protocol, error_msg);
+    if (sock < 0)
+        return nullptr;
+
+    // TTL is applied per send, deadlines are tracked by the worker
+    init_socket(sock, family, -1, 0, detect_mtu);
+    // Receive timestamps as ancillary data, replies are read in batches
+    shared.timestamping = use_kernel_timestamps && enable_timestamping(sock);
+    int on = 1;
+    if (!shared.timestamping && setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+        ALOGE("Error setting timestamp: %d %s", errno, strerror(errno));
+    }
+    reactor->watch(sock, this);
+    shared.fd = sock;
+    shared.family = family;
+    shared.ttl = -1;
+    shared.tx_accepted = shared.tx_failed = shared.tx_skipped = shared.tx_failed_learned = 0;
+    return &shared;
+}
+
+void ProbeManager::set_shared_ttl(SharedSocket &socket, int ttl) {
+    // -1 restores the system default
+    int value = ttl > 0 ? ttl : -1;
+    if (value == socket.ttl)
+        return;
+    int res;
+    if (socket.family == AF_INET) {
+        res = setsockopt(socket.fd, IPPROTO_IP, IP_TTL, &value, sizeof(value));
+    } else {
+        res = setsockopt(socket.fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &value, sizeof(value));
+    }
+    if (res < 0) {
+        ALOGE("Error setting TTL: %d %s", errno, strerror(errno));
+        return;
+    }
+    socket.ttl = value;
+}
+
+size_t ProbeManager::init_send_control(int family, int ttl, char *control, size_t control_size) {
+    memset(control, 0, control_size);
+    msghdr msg{
+            .msg_control = control,
+            .msg_controllen = control_size,
+    };
+    size_t control_len = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    auto add_int = [&](int level, int type, int value) {
+        cmsg->cmsg_level = level;
+        cmsg->cmsg_type = type;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(value));
+        memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+        control_len += CMSG_SPACE(sizeof(value));
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+    };
+    // Only the hop limit varies per probe, init_socket sets the traffic class for both families
+    if (ttl <= 0)
+        return 0;
+    if (family == AF_INET) {
+        add_int(IPPROTO_IP, IP_TTL, ttl);
+    } else {
+        add_int(IPPROTO_IPV6, IPV6_HOPLIMIT, ttl);
+    }
+    return control_len;
+}
+
+ssize_t ProbeManager::send_shared_packet(SharedSocket &socket, const ProbeContext &probe, ProbeDetails &details,
+                                         const sockaddr *addr, socklen_t addr_len) {
+    alignas(struct cmsghdr) char control[SEND_CONTROL_SIZE];
+    struct iovec iov[PACKET_IOV_COUNT];
+    struct msghdr msg{
+            .msg_name = const_cast<sockaddr *>(addr),
+            .msg_namelen = addr_len,
+            .msg_iov = iov,
+            .msg_iovlen = static_cast<size_t>(init_packet_iov(details, iov)),
+    };
+    if (send_control_supported) {
+        // Hop limit travels with the datagram, the socket keeps its defaults
+        msg.msg_controllen = init_send_control(socket.family, probe.ttl, control, sizeof(control));
+        msg.msg_control = msg.msg_controllen > 0 ? control : nullptr;
+    } else {
+        set_shared_ttl(socket, probe.ttl);
+    }
+    auto res = sendmsg(socket.fd, &msg, 0);
+    if (res < 0 && errno == EINVAL && msg.msg_controllen > 0) {
+        // Older kernels reject IP_TTL as ancillary data, retry with setsockopt
+        msg.msg_control = nullptr;
+        msg.msg_controllen = 0;
+        set_shared_ttl(socket, probe.ttl);
+        res = sendmsg(socket.fd, &msg, 0);
+        if (res >= 0 || errno == EMSGSIZE) {
+            ALOGE("Per-datagram TTL is not supported, falling back to setsockopt");
+            send_control_supported = false;
+        }
+    }
+    return res;
+}
+
+void ProbeManager::close_shared_sockets() {
+    for (auto &shared: shared_sockets) {
+        if (shared.fd < 0)
+            continue;
+        reactor->unwatch(shared.fd);
+        close(shared.fd);
+        shared.fd = -1;
+        shared.local_errors.clear();
+        shared.tx_slots.clear();
+    }
+}
+
+bool ProbeManager::allocate_sequence(ProbeHandle handle, ProbeContext &probe) {
+    if (sequence_probes.empty())
+        sequence_probes.resize(0x10000, INVALID_HANDLE);
+    if (sequences_in_use >= sequence_probes.size())
+        return false;
+    // Skip sequences still owned by probes in flight
+    while (sequence_probes[next_sequence] != INVALID_HANDLE)
+        next_sequence++;
+    probe.shared_socket = true;
+    probe.wire_sequence = next_sequence++;
+    sequence_probes[probe.wire_sequence] = handle;
+    sequences_in_use++;
+    return true;
+}
+
+void ProbeManager::init_probe(ProbeContext &probe, const ProbeRequest &request) {
+    probe = {};
+    probe.id = request.id;
+    probe.target = request.target;
+    // Rejected probes may name an unknown target
+    auto *target = find_target(request.target);
+    probe.family = target != nullptr ? target->ss_family : AF_INET;
+    probe.ttl = request.ttl;
+    probe.timeout_ns = request.timeout_us * NSEC_PER_USEC;
+    probe.overhead = (request.probe_type == ProbeType::UDP ? UDP_OVERHEAD : 0) +
+                     (probe.family == AF_INET ? IPV4_OVERHEAD : IPV6_OVERHEAD);
+    probe.probe_type = request.probe_type;
+    probe.sequence = request.sequence % 0xffff;
+    probe.wire_sequence = probe.sequence;
+}
+
+ProbeContext *ProbeManager::allocate_probe(const ProbeRequest &request, ProbeHandle &handle) {
+    handle = probes.allocate();
+    auto *probe = probes.get(handle);
+    if (probe != nullptr) {
+        init_probe(*probe, request);
+        probes.get_cold(handle)->recycle();
+    }
+    return probe;
+}
+
+ProbeCompletion ProbeManager::make_rejected(const ProbeRequest &request, const char *error_msg) {
+    ProbeCompletion completion;
+    init_probe(completion.probe, request);
+    completion.details.error_msg = error_msg;
+    completion.probe.status = ProbeStatus::FATAL_ERROR;
+    return completion;
+}
+
+void ProbeManager::reject_probe(const ProbeRequest &request, const char *error_msg) {
+    auto completion = make_rejected(request, error_msg);
+    trigger_callback(callback_obj, completion);
+}
+
+void ProbeManager::fail_probe(ProbeHandle handle, ProbeContext &probe) {
+    // Reported by the worker along with the other completions
+    probe.status = ProbeStatus::FATAL_ERROR;
+    completed_probes.push_back(handle);
+}
+
+socklen_t ProbeManager::init_remote_addr(const ProbeRequest &request, sockaddr_storage &addr) {
+    // Checked on submission, targets are never removed
+    addr = *find_target(request.target);
+    if (request.probe_type == ProbeType::UDP && request.port > 0) {
+        if (addr.ss_family == AF_INET) {
+            auto *sa_in = reinterpret_cast<struct sockaddr_in *>(&addr);
+            sa_in->sin_port = htons(request.port);
+        } else {
+            auto *sa_in6 = reinterpret_cast<struct sockaddr_in6 *>(&addr);
+            sa_in6->sin6_port = htons(request.port);
+        }
+    }
+    return addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+int ProbeManager::register_pattern(const char *pattern, int pattern_len) {
+    std::lock_guard<std::mutex> lock(patterns_mutex);
+    int pattern_id = pattern_count.load(std::memory_order_relaxed);
+    if (pattern_id >= MAX_PATTERNS) {
+        ALOGE("Too many patterns registered");
+        return SEND_PROBE_ERROR;
+    }
+    patterns[pattern_id] = std::make_shared<const std::vector<char>>(pattern, pattern + std::max(pattern_len, 0));
+    // Senders read the slot without the lock once the count covers it
+    pattern_count.store(pattern_id + 1, std::memory_order_release);
+    return pattern_id;
+}
+
+int ProbeManager::register_target(const char *ip) {
+    sockaddr_storage addr{};
+    if (try_init_addr(AF_INET, ip, addr) <= 0 && try_init_addr(AF_INET6, ip, addr) <= 0) {
+        ALOGE("Invalid network address format");
+        return SEND_PROBE_ERROR;
+    }
+    std::lock_guard<std::mutex> lock(targets_mutex);
+    int target_id = target_count.load(std::memory_order_relaxed);
+    if (target_id >= MAX_TARGETS) {
+        ALOGE("Too many targets registered");
+        return SEND_PROBE_ERROR;
+    }
+    auto &chunk = target_chunks[target_id / TARGET_CHUNK_SIZE];
+    if (chunk == nullptr)
+        chunk = std::make_unique<sockaddr_storage[]>(TARGET_CHUNK_SIZE);
+    chunk[target_id % TARGET_CHUNK_SIZE] = addr;
+    // Like patterns, read without the lock once the count covers the slot
+    target_count.store(target_id + 1, std::memory_order_release);
+    return target_id;
+}
+
+const sockaddr_storage *ProbeManager::find_target(int target_id) {
+    if (target_id < 0 || target_id >= target_count.load(std::memory_order_acquire))
+        return nullptr;
+    return &target_chunks[target_id / TARGET_CHUNK_SIZE][target_id % TARGET_CHUNK_SIZE];
+}
+
+bool ProbeManager::same_host(const sockaddr_storage &a, const sockaddr_storage &b) {
+    if (a.ss_family != b.ss_family)
+        return false;
+    if (a.ss_family == AF_INET)
+        return reinterpret_cast<const sockaddr_in &>(a).sin_addr.s_addr ==
+               reinterpret_cast<const sockaddr_in &>(b).sin_addr.s_addr;
+    return memcmp(&reinterpret_cast<const sockaddr_in6 &>(a).sin6_addr,
+                  &reinterpret_cast<const sockaddr_in6 &>(b).sin6_addr, sizeof(in6_addr)) == 0;
+}
+
+int ProbeManager::send_probe(int id, ProbeType probe_type, int port, int sequence, int ttl, int64_t timeout_us,
+                             int size, bool detect_mtu, int pattern_id, int target) {
+    std::vector<ProbeRequest> requests{{
             .id = id,
-            .remote_ip = remote_ip,
-            .ttl = ttl,
-            .timeout = timeout,
-            .overhead = (probe_type == ProbeType::UDP ? UDP_OVERHEAD : 0) +
-                        (remote_addr.ss_family == AF_INET ? IPV4_OVERHEAD : IPV6_OVERHEAD),
             .probe_type = probe_type,
-            .sequence = sequence % 0xffff,
-    };
+            .port = port,
+            .sequence = sequence,
+            .ttl = ttl,
+            .timeout_us = timeout_us,
+            .size = size,
+            .detect_mtu = detect_mtu,
+            .target = target,
+    }};
+    return send_probes_batch(requests, pattern_id)[0];
+}
 
+ProbePattern ProbeManager::find_pattern(int pattern_id) {
+    if (pattern_id < 0 || pattern_id >= pattern_count.load(std::memory_order_acquire))
+        return nullptr;
+    return patterns[pattern_id];
+}
+
+std::vector<int> ProbeManager::send_probes_batch(const std::vector<ProbeRequest> &requests, int pattern_id) {
+    std::vector<int> results(requests.size(), SEND_PROBE_SUCCESS);
+    auto shared_pattern = find_pattern(pattern_id);
+    if (shared_pattern == nullptr) {
+        for (size_t i = 0; i < requests.size(); i++) {
+            reject_probe(requests[i], "Unknown pattern");
+            results[i] = SEND_PROBE_ERROR;
+        }
+        return results;
+    }
+    if (!begin_submission()) {
+        for (size_t i = 0; i < requests.size(); i++) {
+            reject_probe(requests[i], "Probe manager is stopped");
+            results[i] = SEND_PROBE_ERROR;
+        }
+        return results;
+    }
+    auto extra = std::make_unique<SubmissionExtra>();
+    extra->requests.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (find_target(requests[i].target) == nullptr) {
+            results[i] = SEND_PROBE_ERROR;
+            continue;
+        }
+        extra->requests.push_back(requests[i]);
+    }
+    auto count = static_cast<int>(extra->requests.size());
+    bool submitted = count == 0;
+    if (count > 0) {
+        // Counted before the push, the worker may complete the probes right away
+        queued.fetch_add(count);
+        submitted = submissions.push({
+                .kind = SubmissionKind::PROBE_BATCH,
+                .pattern = shared_pattern,
+                .extra = std::move(extra),
+        });
+        if (submitted) {
+            notify_worker();
+        } else {
+            rollback_queued(count);
+            std::replace(results.begin(), results.end(), SEND_PROBE_SUCCESS, SEND_PROBE_ERROR);
+        }
+    }
+    end_submission();
+    // Callbacks run outside the submission, they may stop the manager
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (results[i] == SEND_PROBE_ERROR)
+            reject_probe(requests[i], find_target(requests[i].target) == nullptr
+                                      ? "Unknown target" : "Submission queue is full");
+    }
+    return results;
+}
+
+int ProbeManager::start_session(const ProbeRequest &request, int pattern_id, const SessionSchedule &schedule) {
+    auto pattern = find_pattern(pattern_id);
+    if (pattern == nullptr) {
+        reject_probe(request, "Unknown pattern");
+        return SEND_PROBE_ERROR;
+    }
+    if (find_target(request.target) == nullptr) {
+        reject_probe(request, "Unknown target");
+        return SEND_PROBE_ERROR;
+    }
+    if (schedule.count == 0 || schedule.interval_ns < 0 || schedule.window < 0 ||
+        (schedule.interval_ns == 0 && schedule.window == 0)) {
+        reject_probe(request, "Invalid session schedule");
+        return SEND_PROBE_ERROR;
+    }
+    if (!begin_submission()) {
+        reject_probe(request, "Probe manager is stopped");
+        return SEND_PROBE_ERROR;
+    }
+    // Listed before the worker sees the session, it drops the entry once the session ends
+    auto stats = std::make_shared<SessionStats>();
+    {
+        std::lock_guard lock(session_stats_mutex);
+        session_stats[request.id] = stats;
+    }
+    queued.fetch_add(1);
+    auto extra = std::make_unique<SubmissionExtra>();
+    extra->schedule = schedule;
+    extra->stats = std::move(stats);
+    bool submitted = submissions.push({
+            .kind = SubmissionKind::START_SESSION,
+            .request = request,
+            .pattern = pattern,
+            .extra = std::move(extra),
+    });
+    if (submitted) {
+        notify_worker();
+    } else {
+        rollback_queued(1);
+    }
+    end_submission();
+    if (!submitted) {
+        drop_session_stats(request.id);
+        reject_probe(request, "Submission queue is full");
+        return SEND_PROBE_ERROR;
+    }
+    return SEND_PROBE_SUCCESS;
+}
+
+int ProbeManager::stop_session(int id) {
+    // Final counters still reach the session end through the worker's reference
+    drop_session_stats(id);
+    ProbeSubmission submission{.kind = SubmissionKind::STOP_SESSION};
+    submission.request.id = id;
+    return submit_control(std::move(submission));
+}
+
+void ProbeManager::drop_session_stats(int id) {
+    std::lock_guard lock(session_stats_mutex);
+    session_stats.erase(id);
+}
+
+bool ProbeManager::get_session_stats(int id, SessionStatsSnapshot &snapshot) {
+    std::lock_guard lock(session_stats_mutex);
+    auto it = session_stats.find(id);
+    if (it == session_stats.end())
+        return false;
+    snapshot = it->second->snapshot(monotonic_ns());
+    return true;
+}
+
+void ProbeManager::start_ping_session(ProbeSubmission &submission) {
+    sessions.push_back({
+            .request = submission.request,
+            .pattern = std::move(submission.pattern),
+            .schedule = submission.extra->schedule,
+            .stats = std::move(submission.extra->stats),
+            .sent = 0,
+            .in_flight = 0,
+            .done = false,
+            .next_send_ns = monotonic_ns(),
+    });
+}
+
+PingSession *ProbeManager::find_ping_session(int id) {
+    for (auto &session: sessions) {
+        if (session.request.id == id)
+            return &session;
+    }
+    return nullptr;
+}
+
+void ProbeManager::finish_ping_session(PingSession &session) {
+    if (session.done)
+        return;
+    session.done = true;
+    session.stats->finish();
+    // Its probes still in flight are counted on their own
+    release_queued(1);
+}
+
+void ProbeManager::report_session_end(SessionEnd &&end) {
+    if (end.stats != nullptr)
+        drop_session_stats(end.id);
+    {
+        std::lock_guard lock(reactor->delivery_mutex);
+        ended_sessions.push_back(std::move(end));
+        reactor->schedule_delivery(this);
+    }
+    reactor->delivery_ready.notify_one();
+}
+
+void ProbeManager::end_ping_session(int id) {
+    auto *session = find_ping_session(id);
+    if (session != nullptr)
+        finish_ping_session(*session);
+}
+
+bool ProbeManager::account_session_probe(const ProbeContext &probe) {
+    auto *session = find_ping_session(probe.id);
+    if (session == nullptr)
+        return true;
+    session->in_flight--;
+    switch (probe.status) {
+        case ProbeStatus::SUCCESS:
+            session->stats->on_received(probe.elapsed_ns / NSEC_PER_USEC);
+            break;
+        case ProbeStatus::TIMEOUT:
+            session->stats->on_lost();
+            break;
+        case ProbeStatus::CANCELLED:
+            // Never waited for, neither lost nor failed
+            break;
+        default:
+            session->stats->on_error();
+    }
+    return session->schedule.report_results;
+}
+
+void ProbeManager::schedule_sessions() {
+    if (sessions.empty())
+        return;
+    int64_t now = monotonic_ns();
+    for (auto it = sessions.begin(); it != sessions.end();) {
+        auto &session = *it;
+        auto &schedule = session.schedule;
+        while (!session.done && session.next_send_ns <= now &&
+               (schedule.window == 0 || session.in_flight < schedule.window)) {
+            // Goes through the same path as submitted probes
+            queued.fetch_add(1);
+            pending_submissions.push_back({.request = session.request, .pattern = session.pattern});
+            session.request.sequence++;
+            session.sent++;
+            session.in_flight++;
+            session.stats->on_sent(now);
+            if (schedule.count >= 0 && session.sent >= schedule.count)
+                finish_ping_session(session);
+            if (schedule.window > 0) {
+                // Spacing counts from this send, a window of replies sets the pace
+                session.next_send_ns = now + schedule.interval_ns;
+                continue;
+            }
+            session.next_send_ns += schedule.interval_ns;
+            // Slots missed while the worker was held up are skipped rather than sent in a burst
+            if (session.next_send_ns <= now)
+                session.next_send_ns +=
+                        ((now - session.next_send_ns) / schedule.interval_ns + 1) * schedule.interval_ns;
+        }
+        if (session.done && session.in_flight == 0) {
+            report_session_end({.id = session.request.id, .span = 1, .stats = session.stats});
+            it = sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int ProbeManager::start_trace(const ProbeRequest &request, int pattern_id, const TracePlan &plan) {
+    auto pattern = find_pattern(pattern_id);
+    if (pattern == nullptr) {
+        reject_probe(request, "Unknown pattern");
+        return SEND_PROBE_ERROR;
+    }
+    if (find_target(request.target) == nullptr) {
+        reject_probe(request, "Unknown target");
+        return SEND_PROBE_ERROR;
+    }
+    auto trace_plan = std::make_shared<TracePlan>(plan);
+    auto &ports = trace_plan->ports;
+    std::sort(ports.exclude.begin(), ports.exclude.end());
+    ports.exclude.erase(std::unique(ports.exclude.begin(), ports.exclude.end()), ports.exclude.end());
+    ports.min = std::max(ports.min, MIN_PORT);
+    ports.max = std::min(ports.max, MAX_PORT);
+    bool valid = plan.max_hops > 0 && (plan.mode == TraceMode::STEPPED
+                                       ? plan.probes_per_hop > 0 && plan.concurrency > 0
+                                       : plan.cycles != 0 && plan.interval_ns >= 0);
+    if (valid && ports.mode == PortMode::RANDOM) {
+        // Drawing ports only ends if one of the range is allowed
+        auto excluded = std::upper_bound(ports.exclude.begin(), ports.exclude.end(), ports.max) -
+                        std::lower_bound(ports.exclude.begin(), ports.exclude.end(), ports.min);
+        valid = ports.min <= ports.max && excluded <= ports.max - ports.min;
+    }
+    if (!valid) {
+        reject_probe(request, "Invalid trace plan");
+        return SEND_PROBE_ERROR;
+    }
+    if (!begin_submission()) {
+        reject_probe(request, "Probe manager is stopped");
+        return SEND_PROBE_ERROR;
+    }
+    queued.fetch_add(1);
+    auto extra = std::make_unique<SubmissionExtra>();
+    extra->plan = std::move(trace_plan);
+    bool submitted = submissions.push({
+            .kind = SubmissionKind::START_TRACE,
+            .request = request,
+            .pattern = pattern,
+            .extra = std::move(extra),
+    });
+    if (submitted) {
+        notify_worker();
+    } else {
+        rollback_queued(1);
+    }
+    end_submission();
+    if (!submitted) {
+        reject_probe(request, "Submission queue is full");
+        return SEND_PROBE_ERROR;
+    }
+    return SEND_PROBE_SUCCESS;
+}
+
+int ProbeManager::stop_trace(int id) {
+    ProbeSubmission submission{.kind = SubmissionKind::STOP_TRACE};
+    submission.request.id = id;
+    return submit_control(std::move(submission));
+}
+
+void ProbeManager::start_trace_session(ProbeSubmission &submission) {
+    int max_hops = submission.extra->plan->max_hops;
+    traces.push_back({
+            .request = submission.request,
+            .pattern = std::move(submission.pattern),
+            .plan = std::move(submission.extra->plan),
+            .sent = 0,
+            .in_flight = 0,
+            .cutoff = max_hops,
+            .done = false,
+            .stopped = false,
+            .next_send_ns = monotonic_ns(),
+    });
+}
+
+TraceSession *ProbeManager::find_trace_session(int probe_id) {
+    for (auto &trace: traces) {
+        int hop = probe_id - trace.request.id + 1;
+        if (hop >= 1 && hop <= trace.plan->max_hops)
+            return &trace;
+    }
+    return nullptr;
+}
+
+void ProbeManager::finish_trace_session(TraceSession &trace) {
+    if (trace.done)
+        return;
+    trace.done = true;
+    release_queued(1);
+}
+
+void ProbeManager::end_trace_session(int id) {
+    auto *trace = find_trace_session(id);
+    if (trace == nullptr)
+        return;
+    trace->stopped = true;
+    finish_trace_session(*trace);
+}
+
+int ProbeManager::resolve_port(const PortPlan &ports, int hop) {
+    switch (ports.mode) {
+        case PortMode::SEQUENTIAL:
+            return ports.start + (hop - 1) * ports.step;
+        case PortMode::RANDOM: {
+            std::uniform_int_distribution<int> range(ports.min, ports.max);
+            int port;
+            do {
+                port = range(port_random);
+            } while (std::binary_search(ports.exclude.begin(), ports.exclude.end(), port));
+            return port;
+        }
+        default:
+            return ports.start;
+    }
+}
+
+void ProbeManager::send_trace_probe(TraceSession &trace, int hop, int sequence) {
+    auto request = trace.request;
+    request.id += hop - 1;
+    request.ttl = hop;
+    request.sequence = sequence;
+    request.port = resolve_port(trace.plan->ports, hop);
+    // Goes through the same path as submitted probes
+    queued.fetch_add(1);
+    pending_submissions.push_back({.request = request, .pattern = trace.pattern});
+    trace.in_flight++;
+}
+
+void ProbeManager::schedule_traces() {
+    if (traces.empty())
+        return;
+    int64_t now = monotonic_ns();
+    for (auto it = traces.begin(); it != traces.end();) {
+        auto &trace = *it;
+        auto &plan = *trace.plan;
+        if (plan.mode == TraceMode::STEPPED) {
+            // Probes of a hop are numbered on, so sequences tell them apart across hops
+            while (!trace.done && trace.in_flight < plan.concurrency) {
+                send_trace_probe(trace, trace.sent / plan.probes_per_hop + 1, trace.sent);
+                trace.sent++;
+                if (trace.sent / plan.probes_per_hop >= trace.cutoff)
+                    finish_trace_session(trace);
+            }
+        } else if (!trace.done && trace.next_send_ns <= now) {
+            // Hops past the destination are not probed again, the cycle is the sequence
+            for (int hop = 1; hop <= trace.cutoff; hop++)
+                send_trace_probe(trace, hop, trace.sent);
+            trace.sent++;
+            if (plan.cycles >= 0 && trace.sent >= plan.cycles) {
+                finish_trace_session(trace);
+            } else {
+                trace.next_send_ns += plan.interval_ns;
+                // Like ping sessions, cycles missed while the worker was held up are skipped
+                if (plan.interval_ns > 0 && trace.next_send_ns <= now)
+                    trace.next_send_ns +=
+                            ((now - trace.next_send_ns) / plan.interval_ns + 1) * plan.interval_ns;
+            }
+        }
+        if (trace.done && trace.in_flight == 0) {
+            report_session_end({.id = trace.request.id, .span = plan.max_hops});
+            it = traces.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool ProbeManager::account_trace_probe(const ProbeContext &probe) {
+    auto *trace = find_trace_session(probe.id);
+    if (trace == nullptr)
+        return true;
+    int hop = probe.id - trace->request.id + 1;
+    trace->in_flight--;
+    if (probe.status == ProbeStatus::ERROR && probe.err_no == EMSGSIZE && trace->request.detect_mtu &&
+        !trace->stopped && hop <= trace->cutoff) {
+        // The path takes no more than the reported MTU, later probes start from it as well
+        int size = static_cast<int>(probe.err_info) - probe.overhead;
+        if (size > 0 && size < static_cast<int>(probe.packet_size)) {
+            trace->request.size = std::min(trace->request.size, size);
+            send_trace_probe(*trace, hop, probe.sequence);
+            return false;
+        }
+    }
+    if (probe.status == ProbeStatus::SUCCESS ||
+        (probe.status == ProbeStatus::ERROR && probe.err_no == ECONNREFUSED)) {
+        if (hop < trace->cutoff) {
+            // Hops past the destination would only run into their timeouts
+            pending_cancels.push_back({
+                    .first_id = trace->request.id + hop,
+                    .last_id = trace->request.id + trace->cutoff - 1,
+                    .report = false,
+            });
+            trace->cutoff = hop;
+            if (trace->plan->mode == TraceMode::STEPPED && trace->sent / trace->plan->probes_per_hop >= hop)
+                finish_trace_session(*trace);
+        }
+    }
+    return hop <= trace->cutoff;
+}
+
+void ProbeManager::process_submissions() {
+    auto &pending = pending_submissions;
+    ProbeSubmission submission;
+    while (pending.size() < SUBMIT_BATCH_SIZE && submissions.pop(submission)) {
+        switch (submission.kind) {
+            case SubmissionKind::START_SESSION:
+                start_ping_session(submission);
+                break;
+            case SubmissionKind::STOP_SESSION:
+                end_ping_session(submission.request.id);
+                break;
+            case SubmissionKind::START_TRACE:
+                start_trace_session(submission);
+                break;
+            case SubmissionKind::STOP_TRACE:
+                end_trace_session(submission.request.id);
+                break;
+            case SubmissionKind::CANCEL:
+                // Probes submitted before the cancel are still pending, they are dropped unsent
+                cancel_probes(submission.extra->cancel);
+                break;
+            case SubmissionKind::PROBE_BATCH:
+                for (auto &request: submission.extra->requests)
+                    pending.push_back({.request = request, .pattern = submission.pattern});
+                break;
+            default:
+                pending.push_back(std::move(submission));
+        }
+    }
+    schedule_sessions();
+    schedule_traces();
+    send_pending();
+}
+
+void ProbeManager::send_pending() {
+    auto &pending = pending_submissions;
+    if (pending.empty())
+        return;
+    // Shared socket probes are grouped by socket
+    for (auto &batch: shared_batches)
+        batch.clear();
+    for (size_t i = 0; i < pending.size(); i++) {
+        auto &request = pending[i].request;
+        if (use_shared_sockets && request.probe_type == ProbeType::ICMP) {
+            shared_batches[shared_index(find_target(request.target)->ss_family, request.detect_mtu)].push_back(i);
+        } else {
+            send_dedicated_probe(pending[i]);
+        }
+    }
+    for (int family: {AF_INET, AF_INET6}) {
+        for (bool detect_mtu: {false, true}) {
+            auto &indices = shared_batches[shared_index(family, detect_mtu)];
+            if (!indices.empty())
+                send_shared_batch(family, detect_mtu, pending, indices);
+        }
+    }
+    pending.clear();
+}
+
+int ProbeManager::submit_control(ProbeSubmission &&submission) {
+    if (!begin_submission())
+        return SEND_PROBE_ERROR;
+    bool submitted = submissions.push(std::move(submission));
+    if (submitted)
+        notify_worker();
+    end_submission();
+    return submitted ? SEND_PROBE_SUCCESS : SEND_PROBE_ERROR;
+}
+
+int ProbeManager::cancel(const CancelFilter &filter) {
+    ProbeSubmission submission{.kind = SubmissionKind::CANCEL, .extra = std::make_unique<SubmissionExtra>()};
+    submission.extra->cancel = filter;
+    return submit_control(std::move(submission));
+}
+
+void ProbeManager::cancel_probes(const CancelFilter &filter) {
+    if (filter.stop) {
+        for (auto &session: sessions) {
+            if (session.request.id >= filter.first_id && session.request.id <= filter.last_id)
+                finish_ping_session(session);
+        }
+        for (auto &trace: traces) {
+            if (trace.request.id < filter.first_id || trace.request.id > filter.last_id)
+                continue;
+            trace.stopped = true;
+            finish_trace_session(trace);
+            // Its hops report under ids of their own
+            cancel_probes({
+                    .first_id = trace.request.id,
+                    .last_id = trace.request.id + trace.plan->max_hops - 1,
+                    .min_ttl = filter.min_ttl,
+                    .report = filter.report,
+            });
+        }
+    }
+    probes.for_each([&filter, this](ProbeHandle handle, ProbeContext &probe) {
+        if (probe.status != ProbeStatus::WAITING || probe.id < filter.first_id || probe.id > filter.last_id ||
+            probe.ttl < filter.min_ttl)
+            return;
+        // Reported along with the other completions, clean_probes releases the socket or sequence
+        probe.status = ProbeStatus::CANCELLED;
+        probe.silent = !filter.report;
+        completed_probes.push_back(handle);
+    });
+    cancel_unsent(filter);
+}
+
+void ProbeManager::cancel_unsent(const CancelFilter &filter) {
+    auto &pending = pending_submissions;
+    std::vector<ProbeCompletion> cancelled;
+    size_t kept = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        auto &request = pending[i].request;
+        if (request.id < filter.first_id || request.id > filter.last_id || request.ttl < filter.min_ttl) {
+            if (kept != i)
+                pending[kept] = std::move(pending[i]);
+            kept++;
+            continue;
+        }
+        auto &completion = cancelled.emplace_back();
+        init_probe(completion.probe, request);
+        completion.probe.status = ProbeStatus::CANCELLED;
+        completion.probe.silent = !filter.report;
+    }
+    if (cancelled.empty())
+        return;
+    pending.erase(pending.begin() + static_cast<ptrdiff_t>(kept), pending.end());
+    // Counted as queued and in flight like sent probes, released the same way
+    std::unique_lock lock(reactor->delivery_mutex);
+    for (auto &completion: cancelled)
+        push_completion(lock, std::move(completion));
+    lock.unlock();
+    reactor->delivery_ready.notify_one();
+}
+
+void ProbeManager::cancel_pending() {
+    for (auto &filter: pending_cancels)
+        cancel_probes(filter);
+    pending_cancels.clear();
+}
+
+void ProbeManager::reject_submissions() {
+    // Trace resends the worker queued for itself
+    for (auto &submission: pending_submissions)
+        enqueue_completion(make_rejected(submission.request, "Probe manager is stopped"));
+    pending_submissions.clear();
+    ProbeSubmission submission;
+    while (submissions.pop(submission)) {
+        switch (submission.kind) {
+            case SubmissionKind::PROBE:
+            case SubmissionKind::START_SESSION:
+            case SubmissionKind::START_TRACE:
+                enqueue_completion(make_rejected(submission.request, "Probe manager is stopped"));
+                break;
+            case SubmissionKind::PROBE_BATCH:
+                for (auto &request: submission.extra->requests)
+                    enqueue_completion(make_rejected(request, "Probe manager is stopped"));
+                break;
+            default:
+                // Stops and cancels were never counted as queued
+                break;
+        }
+    }
+}
+
+void ProbeManager::send_dedicated_probe(const ProbeSubmission &submission) {
+    auto &request = submission.request;
+    sockaddr_storage addr_storage{};
+    socklen_t addr_len = init_remote_addr(request, addr_storage);
+    auto *addr = reinterpret_cast<struct sockaddr *>(&addr_storage);
+
+    int family = addr_storage.ss_family;
     int protocol = IPPROTO_UDP;
-    if (probe_type == ProbeType::ICMP) {
-        protocol = remote_addr.ss_family == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+    if (request.probe_type == ProbeType::ICMP) {
+        protocol = family == AF_INET ? IPPROTO_ICMP : IPPROTO_ICMPV6;
     }
 
-    int sock = socket(remote_addr.ss_family, SOCK_DGRAM, protocol);
+    ProbeHandle handle;
+    auto *probe = allocate_probe(request, handle);
+    if (probe == nullptr) {
+        enqueue_completion(make_rejected(request, "Too many probes in flight"));
+        return;
+    }
+    auto &details = *probes.get_cold(handle);
+
+    int sock = create_socket(family, protocol, details.error_msg);
     if (sock < 0) {
-        probe.error_msg = std::string("Error creating socket: ") + strerror(errno);
-        probe.status = ProbeStatus::FATAL_ERROR;
-        ALOGE("Error creating socket: %d %s", errno, strerror(errno));
-        trigger_callback(callback_obj, probe);
-        return SEND_PROBE_ERROR;
+        fail_probe(handle, *probe);
+        return;
+    }
+
+    init_socket(sock, family, probe->ttl, probe->timeout_ns, request.detect_mtu);
+    // A dedicated socket has a single datagram, any TX stamp belongs to it
+    if (use_kernel_timestamps)
+        enable_timestamping(sock);
+    init_packet_data(*probe, details, request.size, submission.pattern);
+    struct iovec iov[PACKET_IOV_COUNT];
+    struct msghdr msg{
+            .msg_name = const_cast<sockaddr *>(addr),
+            .msg_namelen = addr_len,
+            .msg_iov = iov,
+            .msg_iovlen = static_cast<size_t>(init_packet_iov(details, iov)),
+    };
+
+    probe->sent_ns = monotonic_ns();
+
+    if (sendmsg(sock, &msg, 0) < 0) {
+        if (errno != EMSGSIZE) {
+            ALOGE("Error sending probe: %d %s", errno, strerror(errno));
+            close(sock);
+            details.error_msg = std::string("Error sending probe: ") + strerror(errno);
+            fail_probe(handle, *probe);
+            return;
+        }
+    }
+
+    probe->fd = sock;
+    activate_probe(handle, *probe);
+    reactor->watch(sock, this);
+}
+
+void ProbeManager::send_shared_batch(int family, bool detect_mtu, const std::vector<ProbeSubmission> &pending,
+                                     const std::vector<size_t> &indices) {
+    size_t count = indices.size();
+    auto &batch = send_batch;
+    batch.resize(count);
+    std::string error_msg;
+    auto *shared = get_shared_socket(family, detect_mtu, error_msg);
+    for (size_t k = 0; k < count; k++) {
+        auto &submission = pending[indices[k]];
+        auto &request = submission.request;
+        auto &handle = batch.handles[k];
+        auto *probe = allocate_probe(request, handle);
+        if (probe == nullptr) {
+            enqueue_completion(make_rejected(request, "Too many probes in flight"));
+            continue;
+        }
+        auto &details = *probes.get_cold(handle);
+        if (shared == nullptr) {
+            details.error_msg = error_msg;
+            fail_probe(handle, *probe);
+            continue;
+        }
+        if (!allocate_sequence(handle, *probe)) {
+            details.error_msg = "Too many probes in flight";
+            fail_probe(handle, *probe);
+            continue;
+        }
+        probe->fd = shared->fd;
+        init_packet_data(*probe, details, request.size, submission.pattern);
+
+        auto &msg = batch.msgs[batch.ready.size()].msg_hdr;
+        auto *iov = &batch.iovs[k * PACKET_IOV_COUNT];
+        msg = {
+                .msg_name = &batch.addrs[k],
+                .msg_namelen = init_remote_addr(request, batch.addrs[k]),
+                .msg_iov = iov,
+                .msg_iovlen = static_cast<size_t>(init_packet_iov(details, iov)),
+        };
+        if (send_control_supported) {
+            auto *control = batch.controls[k].data();
+            msg.msg_controllen = init_send_control(family, probe->ttl, control, batch.controls[k].size());
+            msg.msg_control = msg.msg_controllen > 0 ? control : nullptr;
+        }
+        batch.ready.push_back(k);
+    }
+
+    int64_t sent_ns = monotonic_ns();
+    for (size_t k: batch.ready)
+        probes.get(batch.handles[k])->sent_ns = sent_ns;
+
+    auto &ready = batch.ready;
+    auto mark_accepted = [&](size_t k) {
+        batch.tx_slots[k] = {.accepted = shared->tx_accepted++, .failed = shared->tx_failed};
+    };
+    size_t sent = 0;
+    while (sent < ready.size()) {
+        size_t k = ready[sent];
+        auto &probe = *probes.get(batch.handles[k]);
+        auto &details = *probes.get_cold(batch.handles[k]);
+        auto &msg = batch.msgs[sent].msg_hdr;
+        auto *addr = reinterpret_cast<sockaddr *>(&batch.addrs[k]);
+        ssize_t res;
+        if (send_control_supported) {
+            res = sendmmsg(shared->fd, &batch.msgs[sent], ready.size() - sent, 0);
+            if (res > 0) {
+                for (ssize_t i = 0; i < res; i++)
+                    mark_accepted(ready[sent++]);
+                continue;
+            }
+            if (errno == EINVAL && msg.msg_controllen > 0) {
+                // Maybe the kernel rejects the ancillary data, the single send path knows how to fall back
+                res = send_shared_packet(*shared, probe, details, addr, msg.msg_namelen);
+            }
+        } else {
+            res = send_shared_packet(*shared, probe, details, addr, msg.msg_namelen);
+        }
+        if (res >= 0) {
+            mark_accepted(k);
+        } else {
+            shared->tx_failed++;
+            if (errno == EMSGSIZE) {
+                batch.local_errors[k] = true;
+            } else {
+                ALOGE("Error sending probe: %d %s", errno, strerror(errno));
+                details.error_msg = std::string("Error sending probe: ") + strerror(errno);
+                fail_probe(batch.handles[k], probe);
+            }
+        }
+        sent++;
+    }
+
+    for (size_t k: ready) {
+        auto handle = batch.handles[k];
+        auto &probe = *probes.get(handle);
+        if (probe.status != ProbeStatus::WAITING)
+            continue;
+        activate_probe(handle, probe);
+        if (batch.local_errors[k]) {
+            shared->local_errors.push_back(handle);
+        } else if (shared->timestamping) {
+            batch.tx_slots[k].handle = handle;
+            shared->tx_slots.push_back(batch.tx_slots[k]);
+        }
+    }
+}
+
+void ProbeManager::activate_probe(ProbeHandle handle, ProbeContext &probe) {
+    probe.deadline_ns = probe.sent_ns + probe.timeout_ns;
+    deadlines.push({
+            .expires = probe.deadline_ns,
+            .handle = handle,
+    });
+    if (!probe.shared_socket) {
+        if (static_cast<size_t>(probe.fd) >= socket_probes.size())
+            socket_probes.resize(probe.fd + 1, INVALID_HANDLE);
+        socket_probes[probe.fd] = handle;
     }
+}
 
-    if (!source_ip.empty()) {
-        // Bind to specific source address
-        socklen_t source_addr_len = source_addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-        if (bind(sock, reinterpret_cast<sockaddr *>(&source_addr), source_addr_len) < 0) {
-            probe.error_msg = std::string("Error binding socket: ") + strerror(errno);
-            probe.status = ProbeStatus::FATAL_ERROR;
-            ALOGE("Error binding socket: %d %s", errno, strerror(errno));
-            close(sock);
-            trigger_callback(callback_obj, probe);
-            return SEND_PROBE_ERROR;
+void ProbeManager::force_timeouts() {
+    probes.for_each([this](ProbeHandle handle, ProbeContext &probe) {
+        if (probe.status == ProbeStatus::WAITING) {
+            probe.status = ProbeStatus::TIMEOUT;
+            completed_probes.push_back(handle);
+        }
+    });
+}
+
+void ProbeManager::clean_probes() {
+    for (auto handle: completed_probes) {
+        auto *probe = probes.get(handle);
+        if (probe == nullptr)
+            continue;
+        if (probe->shared_socket) {
+            sequence_probes[probe->wire_sequence] = INVALID_HANDLE;
+            sequences_in_use--;
+        } else if (probe->fd >= 0) {
+            reactor->unwatch(probe->fd);
+            close(probe->fd);
+            socket_probes[probe->fd] = INVALID_HANDLE;
         }
+        // Remove it, the slot is reused by the next probe
+        probes.release(handle);
     }
+    completed_probes.clear();
+    // Drop slots of probes resolved before their TX stamp showed up
+    for (auto &shared: shared_sockets) {
+        while (!shared.tx_slots.empty() && probes.get(shared.tx_slots.front().handle) == nullptr)
+            shared.tx_slots.pop_front();
+    }
+}
 
-    init_socket(sock, probe, detect_mtu);
-    init_packet_data(probe, size, pattern, pattern_len);
+ProbeContext *ProbeManager::find_waiting_probe(ProbeHandle handle) {
+    auto *probe = probes.get(handle);
+    if (probe == nullptr || probe->status != ProbeStatus::WAITING)
+        return nullptr;
+    return probe;
+}
 
-    auto local_remote_addr = remote_addr;
+ProbeContext *ProbeManager::find_expiring_probe(const ProbeDeadline &deadline) {
+    // A reused slot may get the handle of an old entry back, its deadline tells them apart
+    auto *probe = find_waiting_probe(deadline.handle);
+    if (probe == nullptr || probe->deadline_ns != deadline.expires)
+        return nullptr;
+    return probe;
+}
 
-    if (probe_type == ProbeType::UDP && port > 0) {
-        if (remote_addr.ss_family == AF_INET) {
-            auto *sa_in = reinterpret_cast<struct sockaddr_in *>(&local_remote_addr);
-            sa_in->sin_port = htons(port);
-        } else {
-            auto *sa_in6 = reinterpret_cast<struct sockaddr_in6 *>(&local_remote_addr);
-            sa_in6->sin6_port = htons(port);
+void ProbeManager::check_timeouts() {
+    int64_t now = monotonic_ns();
+    // Entries of completed probes are dropped lazily as they surface
+    while (!deadlines.empty() && deadlines.top().expires <= now) {
+        auto deadline = deadlines.top();
+        deadlines.pop();
+        auto *probe = find_expiring_probe(deadline);
+        if (probe != nullptr) {
+            probe->status = ProbeStatus::TIMEOUT;
+            completed_probes.push_back(deadline.handle);
         }
     }
+}
 
-    auto *addr = reinterpret_cast<struct sockaddr *>(&local_remote_addr);
-    socklen_t addr_len =
-            local_remote_addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-    gettimeofday(&probe.tv_sent, nullptr);
+void ProbeManager::enqueue_completions() {
+    if (completed_probes.empty())
+        return;
+    std::unique_lock lock(reactor->delivery_mutex);
+    for (auto handle: completed_probes) {
+        auto *probe = probes.get(handle);
+        // The scalars are still needed by clean_probes, the details are taken along
+        if (probe != nullptr)
+            push_completion(lock, {.probe = *probe, .details = std::move(*probes.get_cold(handle))});
+    }
+    lock.unlock();
+    reactor->delivery_ready.notify_one();
+}
 
-    if (sendto(sock, probe.packet_data.data(), probe.packet_data.size(), 0, addr, addr_len) < 0) {
-        if (errno != EMSGSIZE) {
-            ALOGE("Error sending probe: %d %s", errno, strerror(errno));
-            close(sock);
-            probe.error_msg = std::string("Error sending probe: ") + strerror(errno);
-            probe.status = ProbeStatus::FATAL_ERROR;
-            trigger_callback(callback_obj, probe);
-            return SEND_PROBE_ERROR;
+void ProbeManager::push_completion(std::unique_lock<std::mutex> &lock, ProbeCompletion &&completion) {
+    auto &probe = completion.probe;
+    if ((!sessions.empty() && !account_session_probe(probe)) ||
+        (!traces.empty() && !account_trace_probe(probe)) || probe.silent) {
+        release_queued(1);
+        return;
+    }
+    if (probe.status == ProbeStatus::CANCELLED) {
+        // Not a result, Kotlin only lets go of the callback
+        release_probe(probe.id);
+        return;
+    }
+    if (delivery_queue.size() >= delivery_threshold) {
+        if (backpressure == Backpressure::DROP) {
+            dropped.fetch_add(1);
+            release_probe(probe.id);
+            return;
         }
+        // Probes already in flight still get in, new ones wait for the delivery thread
+        delivery_held.store(true);
     }
+    delivery_queue.push_back(std::move(completion));
+    reactor->schedule_delivery(this);
+}
 
-    add_socket(sock, probe);
+void ProbeManager::enqueue_completion(ProbeCompletion &&completion) {
+    std::unique_lock lock(reactor->delivery_mutex);
+    push_completion(lock, std::move(completion));
+    lock.unlock();
+    reactor->delivery_ready.notify_one();
+}
 
-    return SEND_PROBE_SUCCESS;
+void ProbeManager::release_probe(int id) {
+    release_queued(1);
+    released_probes.push_back(id);
+    reactor->schedule_delivery(this);
 }
 
-void ProbeManager::add_socket(int fd, ProbeContext &probe) {
-    std::lock_guard lock(probes_mutex);
-    probes[fd] = probe;
-    epoll_event event{
-            .events = EPOLLIN,
-            .data = {.fd = fd}
-    };
-    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
-    wakeup_event();
+void ProbeManager::release_queued(int count) {
+    // Signalled before the worker parks, this may run with the delivery lock held
+    if (count > 0 && queued.fetch_sub(count) == count)
+        idle_reached = true;
 }
 
-void ProbeManager::force_timeouts() {
-    std::lock_guard lock(probes_mutex);
-    for (auto &probe: probes) {
-        if (probe.second.status == ProbeStatus::WAITING)
-            probe.second.status = ProbeStatus::TIMEOUT;
+void ProbeManager::signal_idle() {
+    {
+        std::lock_guard lock(reactor->delivery_mutex);
+        idle_pending = true;
+        reactor->schedule_delivery(this);
     }
+    reactor->delivery_ready.notify_one();
 }
 
-void ProbeManager::clean_probes() {
-    std::lock_guard lock(probes_mutex);
-    for (auto it = probes.begin(); it != probes.end();) {
-        if (it->second.status != ProbeStatus::WAITING) {
-            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
-            close(it->first);
-            // Remove it
-            it = probes.erase(it);
+// Delivery thread
+bool ProbeManager::has_delivery() const {
+    return !delivery_queue.empty() || !ended_sessions.empty() || !released_probes.empty() || idle_pending;
+}
+
+void ProbeManager::take_delivery(DeliveryBatch &batch) {
+    batch.completions.swap(delivery_queue);
+    batch.ended.swap(ended_sessions);
+    batch.released.swap(released_probes);
+    batch.idle = std::exchange(idle_pending, false);
+}
+
+void ProbeManager::deliver(DeliveryBatch &batch) {
+    bool idle = batch.idle;
+    auto &completions = batch.completions;
+    if (!completions.empty()) {
+        if (result_ring != nullptr) {
+            send_results(completions);
         } else {
-            ++it;
+            send_callbacks(completions);
         }
+        // Counted until the callback has run, waitForCompletion relies on it
+        auto count = static_cast<int>(completions.size());
+        if (queued.fetch_sub(count) == count)
+            idle = true;
     }
+    if (!batch.released.empty() && trigger_released != nullptr)
+        trigger_released(callback_obj, batch.released);
+    if (trigger_session_end != nullptr) {
+        for (auto &end: batch.ended) {
+            SessionStatsSnapshot snapshot{};
+            if (end.stats != nullptr)
+                snapshot = end.stats->snapshot(monotonic_ns());
+            trigger_session_end(callback_obj, end.id, end.span, end.stats != nullptr ? &snapshot : nullptr);
+        }
+    }
+    // Reported after the results, a waiter checks the queue size again anyway
+    if (idle && trigger_idle != nullptr)
+        trigger_idle(callback_obj);
 }
 
-void ProbeManager::check_timeouts() {
-    std::lock_guard lock(probes_mutex);
-    struct timeval tv_now{};
-    gettimeofday(&tv_now, nullptr);
-    for (auto &probe: probes) {
-        if (probe.second.status == ProbeStatus::WAITING) {
-            struct timeval tv_diff{};
-            timersub(&tv_now, &probe.second.tv_sent, &tv_diff);
-            if (TIMEVAL_TO_MS(tv_diff) > probe.second.timeout) {
-                probe.second.status = ProbeStatus::TIMEOUT;
-            }
-        }
+void ProbeManager::send_callbacks(std::vector<ProbeCompletion> &batch) {
+    for (auto &completion: batch)
+        trigger_callback(callback_obj, completion);
+}
+
+void ProbeManager::send_results(std::vector<ProbeCompletion> &batch) {
+    for (auto &completion: batch) {
+        if (write_result(completion))
+            continue;
+        // Out of room, hand over what is there and start over
+        flush_results();
+        if (!write_result(completion))
+            ALOGE("Result does not fit the ring: %zu bytes", completion.details.reply_data.size());
     }
+    flush_results();
 }
 
-void ProbeManager::send_callbacks() {
-    std::lock_guard lock(probes_mutex);
-    for (auto &probe: probes) {
-        if (probe.second.status != ProbeStatus::WAITING) {
-            trigger_callback(callback_obj, probe.second);
-        }
+bool ProbeManager::write_result(const ProbeCompletion &completion) {
+    auto &probe = completion.probe;
+    auto &details = completion.details;
+    ResultRecord record{
+            .id = probe.id,
+            .target = probe.target,
+            .sequence = probe.sequence,
+            .probe_size = static_cast<int32_t>(probe.packet_size),
+            .overhead = probe.overhead,
+            .elapsed_us = static_cast<int32_t>(probe.elapsed_ns / NSEC_PER_USEC),
+            .ttl = probe.reply_ttl,
+            .err_no = static_cast<int32_t>(probe.err_no),
+            .err_code = probe.err_code,
+            .err_type = probe.err_type,
+            .err_info = static_cast<int32_t>(probe.err_info),
+            .reply_size = static_cast<int32_t>(probe.reply_size),
+            .reply_crc = probe.reply_crc,
+    };
+    strncpy(record.offender, details.offender.c_str(), sizeof(record.offender) - 1);
+    const void *payload = nullptr;
+    size_t payload_len = 0;
+    switch (probe.status) {
+        case ProbeStatus::SUCCESS:
+            record.kind = ResultKind::SUCCESS;
+            payload = details.reply_data.data();
+            payload_len = details.reply_data.size();
+            break;
+        case ProbeStatus::TIMEOUT:
+            record.kind = ResultKind::TIMEOUT;
+            break;
+        case ProbeStatus::ERROR:
+            switch (probe.err_no) {
+                case ECONNREFUSED:
+                    record.kind = ResultKind::CONNECTION_REFUSED;
+                    break;
+                case EHOSTUNREACH:
+                    record.kind = ResultKind::HOST_UNREACHABLE;
+                    break;
+                case ENETUNREACH:
+                    record.kind = ResultKind::NET_UNREACHABLE;
+                    break;
+                default:
+                    record.kind = ResultKind::NET_ERROR;
+                    break;
+            }
+            break;
+        default:
+            record.kind = ResultKind::UNKNOWN;
+            payload = details.error_msg.data();
+            payload_len = details.error_msg.size();
+            break;
     }
+    return result_ring->write(record, payload, payload_len);
 }
 
-int ProbeManager::get_min_wait_time() {
-    std::lock_guard lock(probes_mutex);
-    int min_wait_time = -1;
-    struct timeval tv_now{};
-    gettimeofday(&tv_now, nullptr);
+void ProbeManager::flush_results() {
+    size_t from = result_ring->read_position();
+    size_t to = result_ring->write_position();
+    if (from == to)
+        return;
+    trigger_results(callback_obj, from, to);
+    result_ring->release(to);
+}
 
-    for (auto &probe: probes) {
-        if (probe.second.status == ProbeStatus::WAITING) {
-            struct timeval tv_diff{};
-            timersub(&tv_now, &probe.second.tv_sent, &tv_diff);
-            int timeout = probe.second.timeout - TIMEVAL_TO_MS(tv_diff);
-            if (min_wait_time == -1 || timeout < min_wait_time) {
-                min_wait_time = timeout;
-                if (min_wait_time < 0) min_wait_time = 0;
-            }
-        }
+int64_t ProbeManager::get_min_wait_time() {
+    // Trace probes resent from a completion go out on the next pass
+    bool held = delivery_held.load();
+    if (!completed_probes.empty() || (!held && !pending_submissions.empty()))
+        return 0;
+    while (!deadlines.empty() && find_expiring_probe(deadlines.top()) == nullptr)
+        deadlines.pop();
+    int64_t wakeup_ns = deadlines.empty() ? INT64_MAX : deadlines.top().expires;
+    // Only timeouts are due while held, the delivery thread wakes the worker once it is released
+    if (held)
+        return wakeup_ns == INT64_MAX ? -1 : std::max(wakeup_ns - monotonic_ns(), static_cast<int64_t>(0));
+    for (auto &session: sessions) {
+        // A full window waits for a probe to resolve instead
+        if (!session.done && (session.schedule.window == 0 || session.in_flight < session.schedule.window))
+            wakeup_ns = std::min(wakeup_ns, session.next_send_ns);
     }
-    return min_wait_time;
+    for (auto &trace: traces) {
+        // A stepped trace has nothing to wait for but room in its window
+        if (!trace.done && (trace.plan->mode == TraceMode::CONCURRENT || trace.in_flight < trace.plan->concurrency))
+            wakeup_ns = std::min(wakeup_ns, trace.next_send_ns);
+    }
+    if (wakeup_ns == INT64_MAX)
+        return -1;
+    return std::max(wakeup_ns - monotonic_ns(), static_cast<int64_t>(0));
 }
 
 int ProbeManager::get_queue_size() {
-    std::lock_guard lock(probes_mutex);
-    return static_cast<int>(probes.size());
+    // Submitted probes count from the moment they are queued, the slab is worker only
+    return queued.load();
 }
 
 void ProbeManager::read_data(int fd) {
-    std::lock_guard lock(probes_mutex);
-    ProbeContext &probe = probes[fd];
+    for (auto &shared: shared_sockets) {
+        if (shared.fd == fd) {
+            read_shared_data(shared);
+            return;
+        }
+    }
+    if (fd < 0 || static_cast<size_t>(fd) >= socket_probes.size())
+        return;
+    auto handle = socket_probes[fd];
+    // Already resolved, the poller may report the same socket twice
+    auto *probe = find_waiting_probe(handle);
+    if (probe == nullptr)
+        return;
+    read_probe_data(fd, *probe, *probes.get_cold(handle));
+    // A TX timestamp alone leaves the probe waiting
+    if (probe->status != ProbeStatus::WAITING)
+        completed_probes.push_back(handle);
+}
 
-    gettimeofday(&probe.tv_received, nullptr);
+void ProbeManager::read_probe_data(int fd, ProbeContext &probe, ProbeDetails &details) {
+    auto now = sample_clocks();
+    probe.received_ns = now.monotonic_ns;
 
     int flag = MSG_ERRQUEUE;
-    probe.status = ProbeStatus::TIMEOUT;
-    probe.reply_data.resize(INCOMING_BUFFER_SIZE);
-    for (int i = 0; i < 2; i++) {
-        // Step 1. Receive errors
+    size_t reply_len = reply_buffer_size(probe.packet_size);
+    details.reply_data.resize(std::max(reply_len, static_cast<size_t>(INCOMING_BUFFER_SIZE)));
+    while (probe.status == ProbeStatus::WAITING) {
+        // Step 1. Drain errors, TX timestamps are queued there too
         // Step 2. Receive data
 
         // Try to receive errors/control messages
         char control[1024];
         struct iovec iov{
-                .iov_base = probe.reply_data.data(),
-                .iov_len = probe.reply_data.size(),
+                .iov_base = details.reply_data.data(),
+                .iov_len = flag == 0 ? reply_len : details.reply_data.size(),
         };
         struct msghdr msg{
                 .msg_iov = &iov,
@@ -450,49 +1750,265 @@ void ProbeManager::read_data(int fd) {
                 .msg_controllen = sizeof(control),
         };
         auto data_len = recvmsg(fd, &msg, flag | MSG_DONTWAIT);
-        if (data_len >= 0) {
-            struct cmsghdr *cmsg;
-            for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-                if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
-                    (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
-                    auto *err = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cmsg));
-
-                    struct sockaddr *offender = SO_EE_OFFENDER(err);
-                    int family = remote_addr.ss_family;
-                    int addr_len = family == AF_INET ? INET_ADDRSTRLEN : INET6_ADDRSTRLEN;
-                    probe.offender.resize(addr_len);
-                    inet_ntop(family, family == AF_INET
-                                      ? reinterpret_cast<void *>(&reinterpret_cast<struct sockaddr_in *>(offender)->sin_addr)
-                                      : reinterpret_cast<void *>(&reinterpret_cast<struct sockaddr_in6 *>(offender)->sin6_addr),
-                              probe.offender.data(),
-                              addr_len);
-
-                    probe.err_no = err->ee_errno;
-                    probe.err_code = err->ee_code;
-                    probe.err_type = err->ee_origin;
-                    probe.err_info = err->ee_info;
-                    probe.status = ProbeStatus::ERROR;
-                    ioctl(fd, SIOCGSTAMP, &probe.tv_received);
-                } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TTL) ||
-                           (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT)) {
-                    probe.reply_ttl = *reinterpret_cast<int *>(CMSG_DATA(cmsg));
-                }
-            }
-            if (flag == 0) {
-                // Got response
-                probe.status = ProbeStatus::SUCCESS;
-                ioctl(fd, SIOCGSTAMP, &probe.tv_received);
-                probe.reply_data.resize(data_len);
-            }
+        if (data_len < 0) {
+            if (flag == 0)
+                break;
+            flag = 0;
+            continue;
         }
-        if (probe.status == ProbeStatus::ERROR) {
-            // We got what we need, no need to continue
-            break;
+        uint32_t tx_id;
+        if (flag == MSG_ERRQUEUE && parse_tx_timestamp(msg, probe.tx_stamps, tx_id))
+            continue;
+        bool has_timestamp = parse_control(msg, probe, details, now);
+        if (flag == 0) {
+            // Got response
+            probe.status = ProbeStatus::SUCCESS;
+            store_reply(probe, details, details.reply_data.data(), data_len, msg.msg_flags);
         }
-        flag = 0;
+        struct timespec stamp{};
+        if (!has_timestamp && ioctl(fd, SIOCGSTAMPNS, &stamp) == 0)
+            probe.received_ns = kernel_stamp_to_monotonic(stamp, now, probe.sent_ns);
     }
     // Calculate time difference
-    timersub(&probe.tv_received, &probe.tv_sent, &probe.tv_diff);
+    if (probe.status != ProbeStatus::WAITING)
+        probe.elapsed_ns = probe_elapsed_ns(probe);
+}
+
+void ProbeManager::read_shared_data(SharedSocket &socket) {
+    // Errors first, then replies. Drain both queues, one wakeup may cover many probes.
+    const int flags[] = {MSG_ERRQUEUE, 0};
+    size_t reply_len = reply_buffer_size(largest_packet);
+    // Only checksum mode asks for more than the initial buffers, and only once large probes were sent
+    if (reply_len > receive_batch.buffer_size)
+        receive_batch.init(RECEIVE_BATCH_SIZE, reply_len, RECEIVE_CONTROL_SIZE);
+    for (int flag: flags) {
+        int received;
+        do {
+            receive_batch.reset(flag == 0 ? reply_len : INCOMING_BUFFER_SIZE);
+            received = recvmmsg(socket.fd, receive_batch.msgs.data(), RECEIVE_BATCH_SIZE, flag | MSG_DONTWAIT,
+                                nullptr);
+            auto now = sample_clocks();
+            for (int i = 0; i < received; i++)
+                read_shared_message(socket, receive_batch.msgs[i], flag == 0, now);
+        } while (received == RECEIVE_BATCH_SIZE);
+    }
+}
+
+void ProbeManager::read_shared_message(SharedSocket &socket, mmsghdr &message, bool reply,
+                                       const ClockSample &now) {
+    auto &msg = message.msg_hdr;
+    auto *data = reinterpret_cast<uint8_t *>(msg.msg_iov->iov_base);
+    auto data_len = static_cast<ssize_t>(message.msg_len);
+
+    KernelTimestamps tx_stamps;
+    uint32_t tx_id;
+    if (!reply && parse_tx_timestamp(msg, tx_stamps, tx_id)) {
+        match_tx_timestamp(socket, tx_id, tx_stamps);
+        return;
+    }
+
+    ProbeHandle handle = INVALID_HANDLE;
+    uint16_t sequence;
+    if (parse_echo_sequence(socket.family, data, data_len, reply, sequence)) {
+        if (!sequence_probes.empty())
+            handle = sequence_probes[sequence];
+    } else if (!reply && !socket.local_errors.empty()) {
+        // Locally generated error, no quoted header
+        handle = socket.local_errors.front();
+        socket.local_errors.pop_front();
+    }
+    auto *probe = find_waiting_probe(handle);
+    if (probe == nullptr)
+        return;
+    // A late reply of another target may carry a sequence that was handed out again
+    if (reply && !same_host(*reinterpret_cast<sockaddr_storage *>(msg.msg_name), *find_target(probe->target)))
+        return;
+
+    // Shared sockets report stamps as ancillary data, SIOCGSTAMPNS only knows the last datagram of a batch
+    probe->received_ns = now.monotonic_ns;
+    auto &details = *probes.get_cold(handle);
+    parse_control(msg, *probe, details, now);
+    if (reply) {
+        probe->status = ProbeStatus::SUCCESS;
+        store_reply(*probe, details, data, data_len, msg.msg_flags);
+    }
+    if (probe->status != ProbeStatus::WAITING) {
+        probe->elapsed_ns = probe_elapsed_ns(*probe);
+        completed_probes.push_back(handle);
+    }
+}
+
+size_t ProbeManager::reply_buffer_size(size_t packet_size) const {
+    // The echo header is always needed, shared sockets match replies by its sequence
+    switch (payload_mode) {
+        case PayloadMode::NONE:
+            return ICMP_HEADER_SIZE;
+        case PayloadMode::TRUNCATED:
+            return std::clamp(payload_limit, static_cast<size_t>(ICMP_HEADER_SIZE),
+                              static_cast<size_t>(INCOMING_BUFFER_SIZE));
+        case PayloadMode::CHECKSUM:
+            // The CRC covers the whole echoed payload, an echo reply is as large as its request
+            return std::clamp(packet_size, static_cast<size_t>(INCOMING_BUFFER_SIZE),
+                              static_cast<size_t>(MAX_REPLY_SIZE));
+        default:
+            return INCOMING_BUFFER_SIZE;
+    }
+}
+
+void ProbeManager::store_reply(ProbeContext &probe, ProbeDetails &details, const uint8_t *data, size_t data_len,
+                               int msg_flags) const {
+    // Ping sockets return the copied length even with MSG_TRUNC and only flag the truncation,
+    // an echo reply mirrors the request though
+    probe.reply_size = (msg_flags & MSG_TRUNC) != 0 ? std::max(data_len, probe.packet_size) : data_len;
+    if (payload_mode == PayloadMode::CHECKSUM) {
+        probe.reply_crc = data_len > ICMP_HEADER_SIZE
+                          ? static_cast<int64_t>(crc32(0L, data + ICMP_HEADER_SIZE,
+                                                       static_cast<uInt>(data_len - ICMP_HEADER_SIZE)))
+                          : 0;
+    }
+    size_t keep = 0;
+    if (payload_mode == PayloadMode::FULL) {
+        keep = data_len;
+    } else if (payload_mode == PayloadMode::TRUNCATED) {
+        keep = std::min(data_len, payload_limit);
+    }
+    // The dedicated socket path receives into reply_data itself
+    if (data == details.reply_data.data()) {
+        details.reply_data.resize(keep);
+    } else {
+        details.reply_data.assign(data, data + keep);
+    }
+}
+
+bool ProbeManager::parse_echo_sequence(int family, const uint8_t *data, ssize_t data_len, bool reply,
+                                       uint16_t &sequence) {
+    // Replies carry the echo reply header, errors quote the original echo request
+    if (data_len < ICMP_HEADER_SIZE)
+        return false;
+    uint8_t expected_type;
+    if (family == AF_INET) {
+        expected_type = reply ? ICMP_ECHOREPLY : ICMP_ECHO;
+    } else {
+        expected_type = reply ? ICMPV6_ECHO_REPLY : ICMPV6_ECHO_REQUEST;
+    }
+    if (data[0] != expected_type)
+        return false;
+    uint16_t wire_sequence;
+    memcpy(&wire_sequence, data + ICMP_SEQUENCE_OFFSET, sizeof(wire_sequence));
+    sequence = ntohs(wire_sequence);
+    return true;
+}
+
+bool ProbeManager::parse_control(msghdr &msg, ProbeContext &probe, ProbeDetails &details,
+                                 const ClockSample &now) const {
+    bool has_timestamp = false;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+            auto *err = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cmsg));
+
+            struct sockaddr *offender = SO_EE_OFFENDER(err);
+            int family = probe.family;
+            int addr_len = family == AF_INET ? INET_ADDRSTRLEN : INET6_ADDRSTRLEN;
+            details.offender.resize(addr_len);
+            inet_ntop(family, family == AF_INET
+                              ? reinterpret_cast<void *>(&reinterpret_cast<struct sockaddr_in *>(offender)->sin_addr)
+                              : reinterpret_cast<void *>(&reinterpret_cast<struct sockaddr_in6 *>(offender)->sin6_addr),
+                      details.offender.data(),
+                      addr_len);
+
+            probe.err_no = err->ee_errno;
+            probe.err_code = err->ee_code;
+            probe.err_type = err->ee_origin;
+            probe.err_info = err->ee_info;
+            probe.status = ProbeStatus::ERROR;
+        } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_TTL) ||
+                   (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT)) {
+            probe.reply_ttl = *reinterpret_cast<int *>(CMSG_DATA(cmsg));
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp{};
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            probe.received_ns = kernel_stamp_to_monotonic(stamp, now, probe.sent_ns);
+            has_timestamp = true;
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            probe.rx_stamps = parse_timestamping(cmsg);
+            if (probe.rx_stamps.software_ns > 0) {
+                struct timespec stamp{
+                        .tv_sec = static_cast<time_t>(probe.rx_stamps.software_ns / NSEC_PER_SEC),
+                        .tv_nsec = static_cast<long>(probe.rx_stamps.software_ns % NSEC_PER_SEC),
+                };
+                probe.received_ns = kernel_stamp_to_monotonic(stamp, now, probe.sent_ns);
+            }
+            has_timestamp = true;
+        }
+    }
+    return has_timestamp;
+}
+
+KernelTimestamps ProbeManager::parse_timestamping(const cmsghdr *cmsg) {
+    // ts[0] is the software stamp, ts[2] the raw hardware one, ts[1] is unused
+    struct scm_timestamping stamps{};
+    memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+    return {
+            .software_ns = timespec_to_ns(stamps.ts[0]),
+            .hardware_ns = timespec_to_ns(stamps.ts[2]),
+    };
+}
+
+bool ProbeManager::parse_tx_timestamp(msghdr &msg, KernelTimestamps &stamps, uint32_t &tx_id) {
+    // TX stamps come through the error queue as ENOMSG with their own origin
+    bool is_tx = false;
+    KernelTimestamps parsed;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+            auto *err = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cmsg));
+            if (err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+                return false;
+            is_tx = true;
+            tx_id = err->ee_data;
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            parsed = parse_timestamping(cmsg);
+        }
+    }
+    if (is_tx)
+        stamps = parsed;
+    return is_tx;
+}
+
+void ProbeManager::match_tx_timestamp(SharedSocket &socket, uint32_t tx_id, const KernelTimestamps &stamps) {
+    // Stamps arrive in send order, slots before a match lost theirs
+    while (!socket.tx_slots.empty()) {
+        auto &slot = socket.tx_slots.front();
+        uint32_t low = slot.accepted + socket.tx_skipped;
+        uint32_t high = low + (slot.failed - socket.tx_failed_learned);
+        if (static_cast<int32_t>(tx_id - low) < 0)
+            return;
+        if (static_cast<int32_t>(tx_id - high) > 0) {
+            socket.tx_slots.pop_front();
+            continue;
+        }
+        socket.tx_skipped = tx_id - slot.accepted;
+        socket.tx_failed_learned = slot.failed;
+        auto *probe = find_waiting_probe(slot.handle);
+        if (probe != nullptr)
+            probe->tx_stamps = stamps;
+        socket.tx_slots.pop_front();
+        return;
+    }
+}
+
+int64_t ProbeManager::probe_elapsed_ns(const ProbeContext &probe) {
+    // Kernel stamps leave out our own scheduling, pairs of the same clock only
+    auto &tx = probe.tx_stamps;
+    auto &rx = probe.rx_stamps;
+    if (tx.hardware_ns > 0 && rx.hardware_ns >= tx.hardware_ns)
+        return rx.hardware_ns - tx.hardware_ns;
+    if (tx.software_ns > 0 && rx.software_ns >= tx.software_ns)
+        return rx.software_ns - tx.software_ns;
+    return probe.received_ns - probe.sent_ns;
 }
 
 // JNI stuff
@@ -500,80 +2016,114 @@ extern "C" {
 
 JavaVM *java_vm = nullptr;
 
-void trigger_callback(void *obj, ProbeContext &probe) {
-    if (java_vm == nullptr || obj == nullptr || CALLBACK_CLS == nullptr || CALLBACK_MID == nullptr) {
-        ALOGE("JNI not initialized properly");
-        return;
+// Detaches the thread it was created on from the JVM when that thread exits
+struct JniThreadAttachment {
+    JNIEnv *env = nullptr;
+
+    ~JniThreadAttachment() {
+        if (env != nullptr && java_vm != nullptr)
+            java_vm->DetachCurrentThread();
     }
+};
+
+thread_local JniThreadAttachment jni_attachment;
+
+// JNIEnv of the current thread. Native threads are attached on first use and stay attached
+// until they exit, attaching for every callback would create a Java thread object per result.
+JNIEnv *get_jni_env() {
+    if (jni_attachment.env != nullptr)
+        return jni_attachment.env;
     JNIEnv *env;
-    bool attached = false;
     auto getEnvStat = java_vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6);
-    if (getEnvStat == JNI_EDETACHED) {
-        if (java_vm->AttachCurrentThread(&env, nullptr) != 0) {
-            ALOGE("Failed to attach current thread");
-            return;
-        }
-        attached = true;
-    } else if (getEnvStat != JNI_OK) {
+    if (getEnvStat == JNI_OK)
+        return env;
+    if (getEnvStat != JNI_EDETACHED) {
         ALOGE("Failed to get JNI environment");
+        return nullptr;
+    }
+    char name[16] = {};
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    JavaVMAttachArgs args{
+            .version = JNI_VERSION_1_6,
+            .name = name,
+            .group = nullptr,
+    };
+    if (java_vm->AttachCurrentThread(&env, &args) != 0) {
+        ALOGE("Failed to attach current thread");
+        return nullptr;
+    }
+    jni_attachment.env = env;
+    return env;
+}
+
+void trigger_callback(void *obj, ProbeCompletion &completion) {
+    if (java_vm == nullptr || obj == nullptr || CALLBACK_CLS == nullptr || CALLBACK_MID == nullptr) {
+        ALOGE("JNI not initialized properly");
         return;
     }
+    JNIEnv *env = get_jni_env();
+    if (env == nullptr)
+        return;
 
-    auto remote_ip = env->NewStringUTF(probe.remote_ip.c_str());
+    auto &probe = completion.probe;
+    auto &details = completion.details;
+    auto *context = reinterpret_cast<JniCallbackContext *>(obj);
+    // Unknown targets only come with rejected probes, reported against the primary one
+    auto remote_ip = context->target(probe.target);
 
     jobject res_data = nullptr;
 
     switch (probe.status) {
         case ProbeStatus::FATAL_ERROR: {
-            auto err_msg = env->NewStringUTF(probe.error_msg.c_str());
+            auto err_msg = env->NewStringUTF(details.error_msg.c_str());
             res_data = env->NewObject(RESULT_UNKNOWN_CLS, RESULT_UNKNOWN_MID, probe.sequence, remote_ip,
-                                      probe.packet_data.size(), probe.overhead, err_msg);
+                                      probe.packet_size, probe.overhead, err_msg);
             env->DeleteLocalRef(err_msg);
         }
             break;
         case ProbeStatus::SUCCESS: {
-            auto packet_data = env->NewByteArray(static_cast<jint>(probe.reply_data.size()));
-            env->SetByteArrayRegion(packet_data, 0, static_cast<jsize>(probe.reply_data.size()),
-                                    reinterpret_cast<const jbyte *>(probe.reply_data.data()));
+            auto packet_data = env->NewByteArray(static_cast<jint>(details.reply_data.size()));
+            env->SetByteArrayRegion(packet_data, 0, static_cast<jsize>(details.reply_data.size()),
+                                    reinterpret_cast<const jbyte *>(details.reply_data.data()));
             res_data = env->NewObject(RESULT_SUCCESS_CLS, RESULT_SUCCESS_MID, probe.sequence, remote_ip,
-                                      probe.packet_data.size(), probe.overhead, TIMEVAL_TO_USEC(probe.tv_diff),
-                                      probe.reply_ttl, packet_data);
+                                      probe.packet_size, probe.overhead, static_cast<jint>(probe.elapsed_ns / NSEC_PER_USEC),
+                                      probe.reply_ttl, packet_data, static_cast<jint>(probe.reply_size),
+                                      static_cast<jlong>(probe.reply_crc));
             env->DeleteLocalRef(packet_data);
         }
             break;
         case ProbeStatus::TIMEOUT:
             res_data = env->NewObject(RESULT_TIMEOUT_CLS, RESULT_TIMEOUT_MID, probe.sequence, remote_ip,
-                                      probe.packet_data.size(), probe.overhead);
+                                      probe.packet_size, probe.overhead);
             break;
         case ProbeStatus::ERROR: {
-            auto offender = env->NewStringUTF(probe.offender.c_str());
+            auto offender = context->offenders.get(env, details.offender);
             switch (probe.err_no) {
                 case ECONNREFUSED:
                     res_data = env->NewObject(RESULT_CONNECTION_REFUSED_CLS, RESULT_CONNECTION_REFUSED_MID,
-                                              probe.sequence, remote_ip, probe.packet_data.size(), probe.overhead,
+                                              probe.sequence, remote_ip, probe.packet_size, probe.overhead,
                                               offender,
-                                              TIMEVAL_TO_USEC(probe.tv_diff));
+                                              static_cast<jint>(probe.elapsed_ns / NSEC_PER_USEC));
                     break;
                 case EHOSTUNREACH:
                     res_data = env->NewObject(RESULT_HOST_UNREACHABLE_CLS, RESULT_HOST_UNREACHABLE_MID,
-                                              probe.sequence, remote_ip, probe.packet_data.size(), probe.overhead,
+                                              probe.sequence, remote_ip, probe.packet_size, probe.overhead,
                                               offender,
-                                              TIMEVAL_TO_USEC(probe.tv_diff));
+                                              static_cast<jint>(probe.elapsed_ns / NSEC_PER_USEC));
                     break;
                 case ENETUNREACH:
                     res_data = env->NewObject(RESULT_NET_UNREACHABLE_CLS, RESULT_NET_UNREACHABLE_MID,
-                                              probe.sequence, remote_ip, probe.packet_data.size(), probe.overhead,
+                                              probe.sequence, remote_ip, probe.packet_size, probe.overhead,
                                               offender,
-                                              TIMEVAL_TO_USEC(probe.tv_diff));
+                                              static_cast<jint>(probe.elapsed_ns / NSEC_PER_USEC));
                     break;
                 default:
                     res_data = env->NewObject(RESULT_NET_ERROR_CLS, RESULT_NET_ERROR_MID, probe.sequence, remote_ip,
-                                              probe.packet_data.size(), probe.overhead, offender,
+                                              probe.packet_size, probe.overhead, offender,
                                               static_cast<jint>(probe.err_no),
                                               probe.err_code, probe.err_type, probe.err_info);
                     break;
             }
-            env->DeleteLocalRef(offender);
         }
             break;
         default:
@@ -581,12 +2131,10 @@ void trigger_callback(void *obj, ProbeContext &probe) {
             break;
     }
 
-    env->DeleteLocalRef(remote_ip);
-
     if (res_data == nullptr) {
         ALOGE("Failed to create result data");
     } else {
-        env->CallVoidMethod(reinterpret_cast<jobject>(obj), CALLBACK_MID, probe.id, res_data);
+        env->CallVoidMethod(context->manager, CALLBACK_MID, probe.id, res_data);
         env->DeleteLocalRef(res_data);
     }
 
@@ -594,9 +2142,96 @@ void trigger_callback(void *obj, ProbeContext &probe) {
         env->ExceptionDescribe();
         env->ExceptionClear();
     }
+}
+
+void trigger_results(void *obj, size_t from, size_t to) {
+    if (java_vm == nullptr || obj == nullptr || RESULTS_CALLBACK_MID == nullptr) {
+        ALOGE("JNI not initialized properly");
+        return;
+    }
+    JNIEnv *env = get_jni_env();
+    if (env == nullptr)
+        return;
+
+    auto *context = reinterpret_cast<JniCallbackContext *>(obj);
+    env->CallVoidMethod(context->manager, RESULTS_CALLBACK_MID, static_cast<jint>(from), static_cast<jint>(to));
+
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+}
+
+// Order matches the SessionStatsSnapshot fields
+jlongArray new_stats_array(JNIEnv *env, const SessionStatsSnapshot &snapshot) {
+    jlong values[] = {
+            snapshot.sent, snapshot.received, snapshot.lost, snapshot.errors, snapshot.duration_us,
+            snapshot.rtt_min_us, snapshot.rtt_avg_us, snapshot.rtt_max_us,
+            snapshot.rtt_p50_us, snapshot.rtt_p90_us, snapshot.rtt_p99_us,
+    };
+    auto result = env->NewLongArray(static_cast<jsize>(std::size(values)));
+    env->SetLongArrayRegion(result, 0, static_cast<jsize>(std::size(values)), values);
+    return result;
+}
+
+void trigger_released(void *obj, const std::vector<int> &ids) {
+    if (java_vm == nullptr || obj == nullptr || RELEASED_CALLBACK_MID == nullptr) {
+        ALOGE("JNI not initialized properly");
+        return;
+    }
+    JNIEnv *env = get_jni_env();
+    if (env == nullptr)
+        return;
+
+    auto *context = reinterpret_cast<JniCallbackContext *>(obj);
+    auto ids_array = env->NewIntArray(static_cast<jsize>(ids.size()));
+    env->SetIntArrayRegion(ids_array, 0, static_cast<jsize>(ids.size()), ids.data());
+    env->CallVoidMethod(context->manager, RELEASED_CALLBACK_MID, ids_array);
+    env->DeleteLocalRef(ids_array);
+
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+}
+
+void trigger_session_end(void *obj, int id, int span, const SessionStatsSnapshot *stats) {
+    if (java_vm == nullptr || obj == nullptr || SESSION_END_CALLBACK_MID == nullptr) {
+        ALOGE("JNI not initialized properly");
+        return;
+    }
+    JNIEnv *env = get_jni_env();
+    if (env == nullptr)
+        return;
+
+    auto *context = reinterpret_cast<JniCallbackContext *>(obj);
+    jlongArray stats_array = stats != nullptr ? new_stats_array(env, *stats) : nullptr;
+    env->CallVoidMethod(context->manager, SESSION_END_CALLBACK_MID, static_cast<jint>(id), static_cast<jint>(span),
+                        stats_array);
+    if (stats_array != nullptr)
+        env->DeleteLocalRef(stats_array);
+
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
+    }
+}
+
+void trigger_idle(void *obj) {
+    if (java_vm == nullptr || obj == nullptr || IDLE_CALLBACK_MID == nullptr) {
+        ALOGE("JNI not initialized properly");
+        return;
+    }
+    JNIEnv *env = get_jni_env();
+    if (env == nullptr)
+        return;
 
-    if (attached) {
-        java_vm->DetachCurrentThread();
+    auto *context = reinterpret_cast<JniCallbackContext *>(obj);
+    env->CallVoidMethod(context->manager, IDLE_CALLBACK_MID);
+
+    if (env->ExceptionCheck()) {
+        env->ExceptionDescribe();
+        env->ExceptionClear();
     }
 }
 
@@ -646,7 +2281,10 @@ JNIEXPORT void JNICALL JNI_OnUnload(JavaVM *vm, void *) {
 }
 
 JNIEXPORT jlong JNICALL
-Java_me_impa_icmpenguin_ProbeManager_create(JNIEnv *env, jobject thiz, jstring remote_ip, jstring source_ip) {
+Java_me_impa_icmpenguin_ProbeManager_create(JNIEnv *env, jobject thiz, jstring remote_ip, jstring source_ip,
+                                            jboolean shared_sockets, jboolean kernel_timestamps,
+                                            jboolean result_ring, jint backpressure, jint payload_mode,
+                                            jint payload_limit) {
     const char *remote_ip_str = env->GetStringUTFChars(remote_ip, nullptr);
     const char *source_ip_str = env->GetStringUTFChars(source_ip, nullptr);
 
@@ -654,36 +2292,232 @@ Java_me_impa_icmpenguin_ProbeManager_create(JNIEnv *env, jobject thiz, jstring r
 #pragma ide diagnostic ignored "MemoryLeak"
     // No, dear clang, this is not a leak.
     // The lifetime of this class is managed by Kotlin through a descriptor.
-    auto *manager = new ProbeManager(remote_ip_str, source_ip_str,
-                                     env->NewGlobalRef(thiz), trigger_callback);
+    ManagerOptions options{
+            .shared_sockets = shared_sockets != JNI_FALSE,
+            .kernel_timestamps = kernel_timestamps != JNI_FALSE,
+            .result_ring = result_ring != JNI_FALSE,
+            .backpressure = static_cast<Backpressure>(backpressure),
+            .payload_mode = static_cast<PayloadMode>(payload_mode),
+            .payload_limit = static_cast<size_t>(std::max(payload_limit, 0)),
+    };
+    auto *context = new JniCallbackContext{
+            .manager = env->NewGlobalRef(thiz),
+    };
+    // The Kotlin strings are the addresses the manager reports, handed out with every result
+    context->add_target(env, PRIMARY_TARGET, remote_ip);
+    auto *manager = new ProbeManager(remote_ip_str, source_ip_str, options, context, trigger_callback,
+                                     trigger_results, trigger_idle, trigger_session_end, trigger_released);
 
 #pragma clang diagnostic pop
-    manager->start();
     env->ReleaseStringUTFChars(source_ip, source_ip_str);
     env->ReleaseStringUTFChars(remote_ip, remote_ip_str);
+    if (!manager->start()) {
+        // Kotlin throws on 0, nothing else will free these
+        delete manager;
+        context->release(env);
+        delete context;
+        return 0;
+    }
     return reinterpret_cast<jlong>(manager);
 }
 
 JNIEXPORT void JNICALL Java_me_impa_icmpenguin_ProbeManager_delete(JNIEnv *env, jobject /*thiz*/, jlong ptr) {
     auto *manager = reinterpret_cast<ProbeManager *>(ptr);
-    manager->stop();
-    env->DeleteGlobalRef(reinterpret_cast<jobject>(manager->get_callback_obj()));
-    delete manager;
+    auto *context = reinterpret_cast<JniCallbackContext *>(manager->get_callback_obj());
+    // May run later on the delivery thread, which has its own env
+    manager->dispose([manager, context] {
+        delete manager;
+        context->release(get_jni_env());
+        delete context;
+    });
+}
+
+JNIEXPORT jint JNICALL
+Java_me_impa_icmpenguin_ProbeManager_registerPattern(JNIEnv *env, jobject /*thiz*/, jlong ptr, jbyteArray pattern) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    jsize pattern_len = env->GetArrayLength(pattern);
+    std::vector<char> pattern_bytes(pattern_len);
+    env->GetByteArrayRegion(pattern, 0, pattern_len, reinterpret_cast<jbyte *>(pattern_bytes.data()));
+    return manager->register_pattern(pattern_bytes.data(), pattern_len);
+}
+
+JNIEXPORT jint JNICALL
+Java_me_impa_icmpenguin_ProbeManager_registerTarget(JNIEnv *env, jobject /*thiz*/, jlong ptr, jstring ip) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    const char *ip_str = env->GetStringUTFChars(ip, nullptr);
+    int target_id = manager->register_target(ip_str);
+    // Probes only name the id once this returns, their results always find the string
+    if (target_id >= 0)
+        reinterpret_cast<JniCallbackContext *>(manager->get_callback_obj())->add_target(env, target_id, ip);
+    env->ReleaseStringUTFChars(ip, ip_str);
+    return target_id;
 }
 
-JNIEXPORT jint JNICALL Java_me_impa_icmpenguin_ProbeManager_sendProbe(JNIEnv *env, jobject /*thiz*/,
+JNIEXPORT jint JNICALL Java_me_impa_icmpenguin_ProbeManager_sendProbe(JNIEnv * /*env*/, jobject /*thiz*/,
                                                                       jlong ptr, jint id, jint probe_type, jint port,
-                                                                      jint sequence, jint ttl, jint timeout,
+                                                                      jint sequence, jint ttl, jlong timeout_us,
                                                                       jint size, jboolean detect_mtu,
-                                                                      jbyteArray pattern) {
+                                                                      jint pattern_id, jint target) {
     auto *manager = reinterpret_cast<ProbeManager *>(ptr);
-    jbyte *pattern_bytes = env->GetByteArrayElements(pattern, nullptr);
-    int pattern_len = env->GetArrayLength(pattern);
-    int res = manager->send_probe(id, static_cast<ProbeType>(probe_type), port, sequence, ttl, timeout, size,
-                                  detect_mtu, (char *) pattern_bytes,
-                                  pattern_len);
-    env->ReleaseByteArrayElements(pattern, pattern_bytes, JNI_ABORT);
-    return res;
+    return manager->send_probe(id, static_cast<ProbeType>(probe_type), port, sequence, ttl, timeout_us, size,
+                               detect_mtu, pattern_id, target);
+}
+
+JNIEXPORT jint JNICALL Java_me_impa_icmpenguin_ProbeManager_sendProbes(JNIEnv *env, jobject /*thiz*/,
+                                                                       jlong ptr, jint first_id, jint probe_type,
+                                                                       jintArray ports, jintArray sequences,
+                                                                       jintArray ttls, jlong timeout_us,
+                                                                       jintArray sizes, jboolean detect_mtu,
+                                                                       jint pattern_id, jintArray targets) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    jsize count = env->GetArrayLength(ttls);
+    std::vector<jint> port_values(count), sequence_values(count), ttl_values(count), size_values(count);
+    env->GetIntArrayRegion(ports, 0, count, port_values.data());
+    env->GetIntArrayRegion(sequences, 0, count, sequence_values.data());
+    env->GetIntArrayRegion(ttls, 0, count, ttl_values.data());
+    env->GetIntArrayRegion(sizes, 0, count, size_values.data());
+    // No array sends the whole batch to the primary target
+    std::vector<jint> target_values(count, PRIMARY_TARGET);
+    if (targets != nullptr)
+        env->GetIntArrayRegion(targets, 0, count, target_values.data());
+
+    // Ids of a batch are consecutive, the Kotlin side maps them back to array positions
+    std::vector<ProbeRequest> requests(count);
+    for (jsize i = 0; i < count; i++) {
+        requests[i] = {
+                .id = first_id + i,
+                .probe_type = static_cast<ProbeType>(probe_type),
+                .port = port_values[i],
+                .sequence = sequence_values[i],
+                .ttl = ttl_values[i],
+                .timeout_us = timeout_us,
+                .size = size_values[i],
+                .detect_mtu = detect_mtu != JNI_FALSE,
+                .target = target_values[i],
+        };
+    }
+
+    auto results = manager->send_probes_batch(requests, pattern_id);
+    return static_cast<jint>(std::count(results.begin(), results.end(), SEND_PROBE_SUCCESS));
+}
+
+JNIEXPORT jint JNICALL Java_me_impa_icmpenguin_ProbeManager_startSession(JNIEnv * /*env*/, jobject /*thiz*/,
+                                                                         jlong ptr, jint id, jint probe_type, jint port,
+                                                                         jint sequence, jint ttl, jlong timeout_us,
+                                                                         jint size, jint pattern_id, jint count,
+                                                                         jlong interval_us, jint window,
+                                                                         jboolean report_results, jint target) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    ProbeRequest request{
+            .id = id,
+            .probe_type = static_cast<ProbeType>(probe_type),
+            .port = port,
+            .sequence = sequence,
+            .ttl = ttl,
+            .timeout_us = timeout_us,
+            .size = size,
+            .detect_mtu = false,
+            .target = target,
+    };
+    SessionSchedule schedule{
+            .count = count,
+            .interval_ns = interval_us * NSEC_PER_USEC,
+            .window = window,
+            .report_results = report_results != JNI_FALSE,
+    };
+    return manager->start_session(request, pattern_id, schedule);
+}
+
+JNIEXPORT jint JNICALL
+Java_me_impa_icmpenguin_ProbeManager_stopSession([[maybe_unused]] JNIEnv *env, jobject /*thiz*/, jlong ptr, jint id) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    return manager->stop_session(id);
+}
+
+JNIEXPORT jlongArray JNICALL
+Java_me_impa_icmpenguin_ProbeManager_getSessionStats(JNIEnv *env, jobject /*thiz*/, jlong ptr, jint id) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    SessionStatsSnapshot snapshot{};
+    if (!manager->get_session_stats(id, snapshot))
+        return nullptr;
+    return new_stats_array(env, snapshot);
+}
+
+JNIEXPORT jint JNICALL Java_me_impa_icmpenguin_ProbeManager_startTrace(JNIEnv *env, jobject /*thiz*/,
+                                                                       jlong ptr, jint id, jint probe_type,
+                                                                       jlong timeout_us, jint size,
+                                                                       jboolean detect_mtu, jint pattern_id,
+                                                                       jint mode, jint max_hops,
+                                                                       jint probes_per_hop, jint concurrency,
+                                                                       jint cycles, jlong interval_us,
+                                                                       jint port_mode, jint port_start,
+                                                                       jint port_step, jint port_min,
+                                                                       jint port_max, jintArray port_exclude,
+                                                                       jint target) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    ProbeRequest request{
+            .id = id,
+            .probe_type = static_cast<ProbeType>(probe_type),
+            .port = 0,
+            .sequence = 0,
+            .ttl = 1,
+            .timeout_us = timeout_us,
+            .size = size,
+            .detect_mtu = detect_mtu != JNI_FALSE,
+            .target = target,
+    };
+    TracePlan plan{
+            .mode = static_cast<TraceMode>(mode),
+            .max_hops = max_hops,
+            .probes_per_hop = probes_per_hop,
+            .concurrency = concurrency,
+            .cycles = cycles,
+            .interval_ns = interval_us * NSEC_PER_USEC,
+            .ports = {
+                    .mode = static_cast<PortMode>(port_mode),
+                    .start = port_start,
+                    .step = port_step,
+                    .min = port_min,
+                    .max = port_max,
+            },
+    };
+    jsize exclude_count = env->GetArrayLength(port_exclude);
+    plan.ports.exclude.resize(exclude_count);
+    env->GetIntArrayRegion(port_exclude, 0, exclude_count, plan.ports.exclude.data());
+    return manager->start_trace(request, pattern_id, plan);
+}
+
+JNIEXPORT jint JNICALL
+Java_me_impa_icmpenguin_ProbeManager_stopTrace([[maybe_unused]] JNIEnv *env, jobject /*thiz*/, jlong ptr, jint id) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    return manager->stop_trace(id);
+}
+
+JNIEXPORT jint JNICALL
+Java_me_impa_icmpenguin_ProbeManager_cancel([[maybe_unused]] JNIEnv *env, jobject /*thiz*/, jlong ptr, jint first_id,
+                                            jint last_id, jint min_ttl, jboolean stop) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    return manager->cancel({
+            .first_id = first_id,
+            .last_id = last_id,
+            .min_ttl = min_ttl,
+            .stop = stop != JNI_FALSE,
+    });
+}
+
+JNIEXPORT jobject JNICALL
+Java_me_impa_icmpenguin_ProbeManager_getResultBuffer(JNIEnv *env, jobject /*thiz*/, jlong ptr) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    auto *ring = manager->get_result_ring();
+    if (ring == nullptr)
+        return nullptr;
+    return env->NewDirectByteBuffer(ring->data(), static_cast<jlong>(ring->capacity()));
+}
+
+JNIEXPORT jlong JNICALL
+Java_me_impa_icmpenguin_ProbeManager_getDroppedCount([[maybe_unused]] JNIEnv *env, jobject /*thiz*/, jlong ptr) {
+    auto *manager = reinterpret_cast<ProbeManager *>(ptr);
+    return static_cast<jlong>(manager->get_dropped_count());
 }
 
 JNIEXPORT jint JNICALL
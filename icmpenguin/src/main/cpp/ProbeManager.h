@@ -22,117 +22,845 @@
 #import <string>
 #import <thread>
 #import <atomic>
-#import <future>
+#import <deque>
+#import <vector>
+#import <array>
+#import <algorithm>
+#import <queue>
+#import <random>
+#import <unordered_map>
+#import <mutex>
+#import <condition_variable>
+#import "Poller.h"
+#import "MpscQueue.h"
+#import "PayloadCache.h"
+#import "Reactor.h"
+#import "ResultRing.h"
+#import "SessionStats.h"
+#import "Slab.h"
 
 #define SEND_PROBE_ERROR (-1)
 #define SEND_PROBE_SUCCESS 0
 
 #define ICMP_HEADER_SIZE 8
+#define ICMP_SEQUENCE_OFFSET 6
+// Header and payload of a probe go out as separate iovecs
+#define PACKET_IOV_COUNT 2
 #define INCOMING_BUFFER_SIZE 2048
+// Largest ICMP message, checksum mode receives whole replies up to it
+#define MAX_REPLY_SIZE 65535
+// Room for hop limit ancillary data
+#define SEND_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+#define RECEIVE_BATCH_SIZE 32
+#define RECEIVE_CONTROL_SIZE 1024
+// Batches take a single cell, so this only bounds concurrent single sends and control requests
+#define SUBMIT_QUEUE_SIZE 1024
+#define SUBMIT_BATCH_SIZE 1024
+// At most 15 characters, the kernel limit for thread names
+#define WORKER_THREAD_NAME "icmpenguin"
+#define DELIVERY_THREAD_NAME "icmpenguin-dlv"
+// Completions waiting for delivery before backpressure kicks in. A soft limit under BLOCK,
+// probes already in flight still get in past it.
+#define DELIVERY_THRESHOLD 4096
+#define MAX_PATTERNS 256
+// Per address family, with and without path MTU discovery
+#define SHARED_SOCKET_COUNT 4
+// Registered by every manager, fills payloads with zeros
+#define NO_PATTERN 0
+#define MAX_TARGETS 65536
+// Targets are stored in chunks, a manager probing a single host only allocates the first one
+#define TARGET_CHUNK_SIZE 256
+// Registered by every manager, the host it was created for
+#define PRIMARY_TARGET 0
 
 #define DEFAULT_SEND_TIMEOUT 1000
 
+#define MIN_PORT 1
+#define MAX_PORT 65535
+
 #define IPV4_OVERHEAD 20
 #define IPV6_OVERHEAD 40
 #define UDP_OVERHEAD 8
 
 #define MS_TO_SEC(x) (x/1000)
 #define MS_TO_USEC(x) ((x%1000)*1000)
-#define TIMEVAL_TO_MS(x) ((x.tv_sec*1000)+(x.tv_usec/1000))
-#define TIMEVAL_TO_USEC(x) ((x.tv_sec*1000000)+(x.tv_usec))
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_SEC 1000000000LL
+
+#define TIMESTAMPING_FLAGS (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | \
+                            SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_HARDWARE | \
+                            SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE | \
+                            SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
+
+// SO_TIMESTAMPING stamps, 0 when not reported. Software stamps are CLOCK_REALTIME,
+// hardware ones the NIC clock, only stamps of the same source are compared.
+struct KernelTimestamps {
+    int64_t software_ns = 0;
+    int64_t hardware_ns = 0;
+};
 
 enum class ProbeType {
     ICMP = 1, UDP = 2
 };
 enum class ProbeStatus {
-    WAITING = 0, SUCCESS = 1, TIMEOUT = 2, ERROR = 3, FATAL_ERROR = -1
+    WAITING = 0, SUCCESS = 1, TIMEOUT = 2, ERROR = 3, CANCELLED = 4, FATAL_ERROR = -1
 };
 
+using ProbeHandle = SlabHandle;
+
+// Lives in a slab slot and is reused. Only scalars checked on every event, the strings and
+// buffers of a probe are kept apart in its ProbeDetails.
 struct ProbeContext {
+    ProbeStatus status = ProbeStatus::WAITING;
+    // Cancelled without a result
+    bool silent = false;
+    bool shared_socket = false;
+    uint16_t wire_sequence = 0;
+    int fd = -1;
+    // Registered destination and its address family
+    int target;
+    int family;
+    // CLOCK_MONOTONIC, kernel receive stamps are converted on read
+    int64_t deadline_ns;
+    int64_t sent_ns;
+    int64_t received_ns;
+    int64_t elapsed_ns;
+    int64_t timeout_ns;
     int id;
-    std::string remote_ip;
-    std::string offender;
-    std::vector<uint8_t> packet_data;
-    std::vector<uint8_t> reply_data;
+    int sequence;
     int ttl;
     int reply_ttl;
-    int timeout;
     int overhead;
     ProbeType probe_type;
-    struct timeval tv_sent;
-    struct timeval tv_received;
-    struct timeval tv_diff;
-    int sequence;
-    std::string error_msg;
     unsigned int err_no;
     int err_code;
     int err_type;
     unsigned int err_info;
-    ProbeStatus status = ProbeStatus::WAITING;
+    KernelTimestamps tx_stamps;
+    KernelTimestamps rx_stamps;
+    size_t packet_size;
+    // Whole reply, even when ProbeDetails::reply_data holds less of it
+    size_t reply_size;
+    // CRC32 of the echoed payload in PayloadMode::CHECKSUM, -1 otherwise
+    int64_t reply_crc = -1;
+};
+
+// Cold part of a probe in the other half of its slab slot, only touched when the probe is sent or resolves
+struct ProbeDetails {
+    std::string offender;
+    std::string error_msg;
+    // Echo header with the probe's wire sequence, empty for UDP probes
+    std::array<uint8_t, ICMP_HEADER_SIZE> header;
+    size_t header_len = 0;
+    // Everything past the header, shared with probes of the same size and pattern
+    PacketPayload payload;
+    // What payload_mode keeps of the reply
+    std::vector<uint8_t> reply_data;
+
+    // Clears every field but keeps the buffers of the previous probe
+    void recycle() {
+        offender.clear();
+        error_msg.clear();
+        header_len = 0;
+        payload.reset();
+        reply_data.clear();
+    }
+};
+
+// A resolved probe on its way to the delivery thread
+struct ProbeCompletion {
+    ProbeContext probe;
+    ProbeDetails details;
+};
+
+// A session or trace the worker let go of, delivered after its last result
+struct SessionEnd {
+    int id;
+    // Ids reported under, the hops of a trace
+    int span;
+    // Final counters of a ping session
+    std::shared_ptr<SessionStats> stats;
+};
+
+// Probe waiting for its TX timestamp. Stamps carry the socket's OPT_ID counter, which
+// older kernels also advance for sends failing locally, so only a range of ids is known
+// until a stamp pins it down.
+struct TxStampSlot {
+    uint32_t accepted;
+    uint32_t failed;
+    ProbeHandle handle;
+};
+
+// Long-lived ICMP socket carrying many probes. Replies and errors are matched
+// back to probes by the echo sequence written on the wire.
+struct SharedSocket {
+    int fd = -1;
+    int family = AF_INET;
+    // Socket level TTL, only used when per-datagram TTL is unavailable
+    int ttl = -1;
+    // Probes whose send failed locally with EMSGSIZE. The kernel queues these
+    // errors without the original header, so they are matched in send order.
+    std::deque<ProbeHandle> local_errors;
+    // SO_TIMESTAMPING is on, TX stamps are matched through tx_slots
+    bool timestamping = false;
+    std::deque<TxStampSlot> tx_slots;
+    uint32_t tx_accepted = 0;
+    uint32_t tx_failed = 0;
+    // Failed sends known to have taken a TX stamp id, and how many failures that covers
+    uint32_t tx_skipped = 0;
+    uint32_t tx_failed_learned = 0;
+};
+
+// Preallocated buffers for draining a shared socket with recvmmsg
+struct ReceiveBatch {
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    // Sources of the datagrams
+    std::vector<sockaddr_storage> addrs;
+    std::vector<uint8_t> buffers;
+    std::vector<char> controls;
+    size_t buffer_size = 0;
+    size_t control_size = 0;
+
+    void init(size_t count, size_t buffer_len, size_t control_len) {
+        buffer_size = buffer_len;
+        msgs.resize(count);
+        iovs.resize(count);
+        addrs.resize(count);
+        buffers.resize(count * buffer_size);
+        controls.resize(count * control_len);
+        control_size = control_len;
+        for (size_t i = 0; i < count; i++) {
+            iovs[i] = {
+                    .iov_base = buffers.data() + i * buffer_size,
+                    .iov_len = buffer_size,
+            };
+        }
+        reset(buffer_size);
+    }
+
+    // recvmmsg overwrites lengths and flags, restore them before every call.
+    // data_len caps what the kernel copies of each datagram.
+    void reset(size_t data_len) {
+        for (size_t i = 0; i < msgs.size(); i++) {
+            iovs[i].iov_len = std::min(data_len, buffer_size);
+            msgs[i] = {
+                    .msg_hdr = {
+                            .msg_name = &addrs[i],
+                            .msg_namelen = sizeof(sockaddr_storage),
+                            .msg_iov = &iovs[i],
+                            .msg_iovlen = 1,
+                            .msg_control = controls.data() + i * control_size,
+                            .msg_controllen = control_size,
+                    },
+            };
+        }
+    }
+};
+
+// Clocks read back to back, maps realtime kernel stamps onto the monotonic clock
+struct ClockSample {
+    int64_t monotonic_ns;
+    int64_t realtime_ns;
+};
+
+// Scratch buffers for sending a batch of probes, reused between batches
+struct SendBatch {
+    std::vector<ProbeHandle> handles;
+    std::vector<sockaddr_storage> addrs;
+    std::vector<iovec> iovs;
+    std::vector<mmsghdr> msgs;
+    std::vector<std::array<char, SEND_CONTROL_SIZE>> controls;
+    std::vector<TxStampSlot> tx_slots;
+    std::vector<bool> local_errors;
+    // Positions of the probes that made it to msgs
+    std::vector<size_t> ready;
+
+    void resize(size_t count) {
+        handles.assign(count, INVALID_HANDLE);
+        addrs.resize(count);
+        iovs.resize(count * PACKET_IOV_COUNT);
+        msgs.resize(count);
+        controls.resize(count);
+        tx_slots.resize(count);
+        local_errors.assign(count, false);
+        ready.clear();
+    }
+};
+
+struct ProbeDeadline {
+    int64_t expires;
+    ProbeHandle handle;
+
+    bool operator>(const ProbeDeadline &other) const { return expires > other.expires; }
+};
+
+struct ProbeRequest {
+    int id;
+    ProbeType probe_type;
+    int port;
+    int sequence;
+    int ttl;
+    int64_t timeout_us;
+    int size;
+    bool detect_mtu;
+    // Id from register_target, PRIMARY_TARGET for the host the manager was created for
+    int target;
+};
+
+enum class SubmissionKind : uint8_t {
+    PROBE = 0,
+    START_SESSION = 1,
+    STOP_SESSION = 2,
+    START_TRACE = 3,
+    STOP_TRACE = 4,
+    CANCEL = 5,
+    // Probes of one send_probes_batch call sharing a pattern
+    PROBE_BATCH = 6,
+};
+
+// Probes in flight to resolve right away as ProbeStatus::CANCELLED
+struct CancelFilter {
+    // Probe id range, both inclusive
+    int first_id = 0;
+    int last_id = -1;
+    // Only probes sent with at least this TTL, 0 for any
+    int min_ttl = 0;
+    // Released probes are handed to Kotlin, off for trace hops the trace itself lets go of
+    bool report = true;
+    // Also stop the ping sessions and traces whose ids fall in the range, with all their probes
+    bool stop = false;
 };
 
-using JNICallback = std::function<void(void *, ProbeContext &)>;
+// When the probes of a ping session go out
+struct SessionSchedule {
+    // A negative count never ends
+    int count = 0;
+    // Between two sends. With a window only the minimum spacing, 0 sends as soon as the window allows
+    int64_t interval_ns = 0;
+    // Probes in flight at most, the next one goes out once an earlier one resolves. 0 keeps to the interval.
+    int window = 0;
+    // Otherwise results only feed the session statistics
+    bool report_results = true;
+};
+
+enum class TraceMode {
+    // Hop by hop, a few probes per hop with a limited number in flight
+    STEPPED = 0,
+    // Every hop at once, repeated in cycles
+    CONCURRENT = 1,
+};
+
+enum class PortMode {
+    FIXED = 0,
+    SEQUENTIAL = 1,
+    RANDOM = 2,
+};
+
+// Destination port of UDP trace probes
+struct PortPlan {
+    PortMode mode = PortMode::FIXED;
+    // The FIXED port, or the one of the first hop for SEQUENTIAL
+    int start = 0;
+    int step = 0;
+    // RANDOM range, both inclusive
+    int min = MIN_PORT;
+    int max = MAX_PORT;
+    std::vector<int> exclude;
+};
+
+// How a trace walks the hops
+struct TracePlan {
+    TraceMode mode = TraceMode::STEPPED;
+    int max_hops = 0;
+    // STEPPED only
+    int probes_per_hop = 0;
+    int concurrency = 0;
+    // CONCURRENT only, negative cycles never end
+    int cycles = 0;
+    int64_t interval_ns = 0;
+    PortPlan ports;
+};
+
+// What the rarer submission kinds carry besides the request
+struct SubmissionExtra {
+    // START_SESSION only
+    SessionSchedule schedule;
+    std::shared_ptr<SessionStats> stats;
+    // START_TRACE only
+    std::shared_ptr<const TracePlan> plan;
+    // CANCEL only
+    CancelFilter cancel;
+    // PROBE_BATCH only
+    std::vector<ProbeRequest> requests;
+};
+
+// A probe handed from a sending thread to the worker, or a ping session or trace to start or stop.
+// Kept to a probe descriptor, every queue cell holds one.
+struct ProbeSubmission {
+    SubmissionKind kind = SubmissionKind::PROBE;
+    ProbeRequest request;
+    ProbePattern pattern;
+    std::unique_ptr<SubmissionExtra> extra;
+};
+
+// Probes the worker sends by itself, all reported under the session id. Kept until the last one resolves.
+struct PingSession {
+    // The next probe to send
+    ProbeRequest request;
+    ProbePattern pattern;
+    SessionSchedule schedule;
+    std::shared_ptr<SessionStats> stats;
+    int sent;
+    int in_flight;
+    // Set once no more probes are sent
+    bool done;
+    // CLOCK_MONOTONIC. Without a window the slots are fixed, so the worker's own delays do not add up.
+    int64_t next_send_ns;
+};
+
+// Traceroute the worker runs by itself. Hop n reports under the trace id + n - 1 and nothing past the
+// destination is reported once a hop answers for it. Kept until the last probe resolves.
+struct TraceSession {
+    // Probe type, timeout and size of every probe, the id is the one of hop 1
+    ProbeRequest request;
+    ProbePattern pattern;
+    std::shared_ptr<const TracePlan> plan;
+    // STEPPED: probes sent so far, CONCURRENT: cycles sent so far
+    int sent;
+    int in_flight;
+    // The first hop the destination answered from, max_hops until then
+    int cutoff;
+    // Set once no more hops are scheduled, EMSGSIZE resends still go out
+    bool done;
+    // Set by stop_trace, nothing is sent anymore
+    bool stopped;
+    // CLOCK_MONOTONIC, when the next CONCURRENT cycle is due
+    int64_t next_send_ns;
+};
+
+// How much of an echo reply is handed to the callback
+enum class PayloadMode {
+    FULL = 0,
+    // Nothing, only the size
+    NONE = 1,
+    // The first payload_limit bytes
+    TRUNCATED = 2,
+    // CRC32 of the echoed payload instead of the bytes
+    CHECKSUM = 3
+};
+
+// What the worker does when completions pile up faster than they are delivered
+enum class Backpressure {
+    // Start no new probes for the manager until its deliveries catch up. Completions of probes
+    // already in flight are still queued, so the threshold may be exceeded by that many.
+    BLOCK = 0,
+    // Throw the completion away and count it
+    DROP = 1
+};
+
+struct ManagerOptions {
+    bool shared_sockets = true;
+    // Take RTTs from kernel TX/RX timestamps, falls back to user space send times
+    bool kernel_timestamps = true;
+    // Deliver completions as records in a shared ring, one upcall per batch
+    bool result_ring = false;
+    Backpressure backpressure = Backpressure::BLOCK;
+    size_t delivery_threshold = DELIVERY_THRESHOLD;
+    PayloadMode payload_mode = PayloadMode::FULL;
+    // Bytes kept in PayloadMode::TRUNCATED
+    size_t payload_limit = 0;
+};
+
+using JNICallback = std::function<void(void *, ProbeCompletion &)>;
+// Records between the two ring positions are ready, consumed by the time it returns
+using JNIResultsCallback = std::function<void(void *, size_t, size_t)>;
+// No submitted probe is left, everything reported so far has been delivered
+using JNIIdleCallback = std::function<void(void *)>;
+// Nothing is reported under the ids of the session anymore, stats is null for traces
+using JNISessionEndCallback = std::function<void(void *, int, int, const SessionStatsSnapshot *)>;
+// Cancelled or dropped probes, their callbacks are never invoked
+using JNIReleasedCallback = std::function<void(void *, const std::vector<int> &)>;
+
+// What the delivery thread takes from a manager in one go
+struct DeliveryBatch {
+    std::vector<ProbeCompletion> completions;
+    std::vector<SessionEnd> ended;
+    std::vector<int> released;
+    bool idle = false;
+
+    void clear() {
+        completions.clear();
+        ended.clear();
+        released.clear();
+        idle = false;
+    }
+};
 
 class ProbeManager {
 private:
+    friend class Reactor;
 
     void *callback_obj = nullptr;
     JNICallback trigger_callback;
-
-    std::unordered_map<int, ProbeContext> probes;
-    std::mutex probes_mutex;
+    JNIResultsCallback trigger_results;
+    JNIIdleCallback trigger_idle;
+    JNISessionEndCallback trigger_session_end;
+    JNIReleasedCallback trigger_released;
+    std::unique_ptr<ResultRing> result_ring;
+    // Set while attached, the worker and delivery threads shared by all managers
+    Reactor *reactor = nullptr;
+    // Completions handed from the worker to the delivery thread, guarded by the reactor delivery_mutex
+    std::vector<ProbeCompletion> delivery_queue;
+    // The queue ran empty, reported by the delivery thread after the completions it holds
+    bool idle_pending = false;
+    // Sessions and traces done with, reported after the completions queued before them
+    std::vector<SessionEnd> ended_sessions;
+    // Ids of cancelled and dropped probes, Kotlin lets go of their callbacks
+    std::vector<int> released_probes;
+    // Waiting in the reactor delivery order, or being delivered
+    bool delivery_listed = false;
+    bool delivering = false;
+    // Let go of by the worker, guarded by the reactor delivery_mutex
+    bool detached = false;
+    // BLOCK backpressure hit, the worker starts nothing new for the manager until it is delivered
+    std::atomic<bool> delivery_held{false};
+    Backpressure backpressure;
+    size_t delivery_threshold;
+    std::atomic<uint64_t> dropped{0};
+
+    Slab<ProbeContext, ProbeDetails> probes;
+    // Dedicated socket probes indexed by fd, shared socket ones by wire sequence
+    std::vector<ProbeHandle> socket_probes;
+    std::vector<ProbeHandle> sequence_probes;
+    size_t sequences_in_use = 0;
+    // Everything above is owned by the worker, senders only reach it through this queue
+    MpscQueue<ProbeSubmission> submissions{SUBMIT_QUEUE_SIZE};
+    std::vector<ProbeSubmission> pending_submissions;
+    std::array<std::vector<size_t>, SHARED_SOCKET_COUNT> shared_batches;
+    // Each running session counts as one queued probe until its last probe is sent
+    std::vector<PingSession> sessions;
+    // Outlive their sessions, so statistics can be read once a session is over
+    std::unordered_map<int, std::shared_ptr<SessionStats>> session_stats;
+    std::mutex session_stats_mutex;
+    // Each running trace counts as one queued probe until its last hop is scheduled
+    std::vector<TraceSession> traces;
+    // Random trace ports
+    std::minstd_rand port_random{std::random_device{}()};
+    // Hops past a trace cutoff, cancelled once the completions of the pass are handed over
+    std::vector<CancelFilter> pending_cancels;
+    // Registered patterns, never changed once published through pattern_count
+    std::array<ProbePattern, MAX_PATTERNS> patterns;
+    std::atomic<int> pattern_count{0};
+    std::mutex patterns_mutex;
+    // Submitted probes not reported yet
+    std::atomic<int> queued{0};
+    // Senders between checking running and handing their submission over, stop() waits for them
+    std::atomic<int> submitting{0};
+    std::mutex submitting_mutex;
+    std::condition_variable submissions_done;
+    // A sender took queued to zero undoing its submission, the worker signals idle for it
+    std::atomic<bool> idle_requested{false};
+    // The worker took queued to zero, idle is signalled once the pass is over
+    bool idle_reached = false;
+    bool use_shared_sockets;
+    bool use_kernel_timestamps;
+    PayloadMode payload_mode;
+    size_t payload_limit;
+    // Indexed by shared_index(), one per address family and path MTU discovery setting
+    SharedSocket shared_sockets[SHARED_SOCKET_COUNT];
+    // Min-heap of probe deadlines, entries of resolved probes are skipped lazily
+    std::priority_queue<ProbeDeadline, std::vector<ProbeDeadline>, std::greater<>> deadlines;
+    // Probes resolved since the last pass, pending callbacks and cleanup
+    std::vector<ProbeHandle> completed_probes;
+    uint16_t next_sequence = 0;
+    // Cleared when the kernel rejects per-datagram TTL
+    bool send_control_supported = true;
+    ReceiveBatch receive_batch;
+    // Largest probe sent so far, shared sockets size their receive buffers for its reply
+    size_t largest_packet = 0;
+    SendBatch send_batch;
+    PayloadCache payloads;
     int ident;
-    struct sockaddr_storage remote_addr{};
+    // Echo request headers of this manager by family_index(), probes only patch the sequence in
+    std::array<std::array<uint8_t, ICMP_HEADER_SIZE>, 2> echo_headers{};
+    // Registered destinations, never changed once published through target_count
+    std::array<std::unique_ptr<sockaddr_storage[]>, MAX_TARGETS / TARGET_CHUNK_SIZE> target_chunks;
+    std::atomic<int> target_count{0};
+    std::mutex targets_mutex;
     struct sockaddr_storage source_addr{};
-    std::string remote_ip;
     std::string source_ip;
-    std::thread worker;
     std::atomic<bool> running{false};
-    int epoll_fd = -1;
-    int wakeup_fd = -1;
-    std::promise<void> start_promise;
+
+    static int64_t timespec_to_ns(const struct timespec &ts);
+
+    static int64_t monotonic_ns();
+
+    static ClockSample sample_clocks();
+
+    static int64_t kernel_stamp_to_monotonic(const struct timespec &stamp, const ClockSample &now, int64_t sent_ns);
 
     int try_init_addr(int family, const char *addr, sockaddr_storage &addr_storage);
 
-    void init_packet_data(ProbeContext &probe, int size, char *pattern, int pattern_len) const;
+    void init_echo_headers();
+
+    static int family_index(int family) { return family == AF_INET6 ? 1 : 0; }
+
+    static size_t shared_index(int family, bool detect_mtu) { return family_index(family) * 2 + (detect_mtu ? 1 : 0); }
+
+    // nullptr for an unknown target id
+    const sockaddr_storage *find_target(int target_id);
+
+    static bool same_host(const sockaddr_storage &a, const sockaddr_storage &b);
+
+    void init_packet_data(ProbeContext &probe, ProbeDetails &details, int size, const ProbePattern &pattern);
+
+    static int init_packet_iov(ProbeDetails &details, iovec *iov);
+
+    static void init_socket(int sock, int family, int ttl, int64_t timeout_ns, bool detect_mtu);
+
+    bool enable_timestamping(int sock) const;
 
-    void init_socket(int sock, ProbeContext &probe, bool detect_mtu) const;
+    int create_socket(int family, int protocol, std::string &error_msg);
 
-    void add_socket(int fd, ProbeContext &probe);
+    SharedSocket *get_shared_socket(int family, bool detect_mtu, std::string &error_msg);
+
+    static void set_shared_ttl(SharedSocket &socket, int ttl);
+
+    static size_t init_send_control(int family, int ttl, char *control, size_t control_size);
+
+    ssize_t send_shared_packet(SharedSocket &socket, const ProbeContext &probe, ProbeDetails &details,
+                               const sockaddr *addr, socklen_t addr_len);
+
+    void close_shared_sockets();
+
+    bool allocate_sequence(ProbeHandle handle, ProbeContext &probe);
+
+    void init_probe(ProbeContext &probe, const ProbeRequest &request);
+
+    ProbeContext *allocate_probe(const ProbeRequest &request, ProbeHandle &handle);
+
+    ProbeCompletion make_rejected(const ProbeRequest &request, const char *error_msg);
+
+    void reject_probe(const ProbeRequest &request, const char *error_msg);
+
+    void fail_probe(ProbeHandle handle, ProbeContext &probe);
+
+    socklen_t init_remote_addr(const ProbeRequest &request, sockaddr_storage &addr);
+
+    void process_submissions();
+
+    void start_ping_session(ProbeSubmission &submission);
+
+    void end_ping_session(int id);
+
+    void schedule_sessions();
+
+    void finish_ping_session(PingSession &session);
+
+    // Hands the end over to the delivery thread, the session is gone from the worker
+    void report_session_end(SessionEnd &&end);
+
+    void drop_session_stats(int id);
+
+    PingSession *find_ping_session(int id);
+
+    // Returns false when the result is not to be delivered
+    bool account_session_probe(const ProbeContext &probe);
+
+    void start_trace_session(ProbeSubmission &submission);
+
+    void end_trace_session(int id);
+
+    void schedule_traces();
+
+    void send_trace_probe(TraceSession &trace, int hop, int sequence);
+
+    void finish_trace_session(TraceSession &trace);
+
+    TraceSession *find_trace_session(int probe_id);
+
+    int resolve_port(const PortPlan &ports, int hop);
+
+    // Returns false when the result is not to be delivered
+    bool account_trace_probe(const ProbeContext &probe);
+
+    void cancel_probes(const CancelFilter &filter);
+
+    // Probes still waiting in pending_submissions never reach the wire
+    void cancel_unsent(const CancelFilter &filter);
+
+    void cancel_pending();
+
+    void send_pending();
+
+    void reject_submissions();
+
+    void send_dedicated_probe(const ProbeSubmission &submission);
+
+    void send_shared_batch(int family, bool detect_mtu, const std::vector<ProbeSubmission> &pending,
+                           const std::vector<size_t> &indices);
+
+    void activate_probe(ProbeHandle handle, ProbeContext &probe);
+
+    ProbeContext *find_waiting_probe(ProbeHandle handle);
+
+    ProbeContext *find_expiring_probe(const ProbeDeadline &deadline);
 
     void check_timeouts();
 
     void clean_probes();
 
-    void send_callbacks();
+    void enqueue_completions();
+
+    void push_completion(std::unique_lock<std::mutex> &lock, ProbeCompletion &&completion);
+
+    // Caller holds the reactor delivery_mutex
+    void release_probe(int id);
+
+    void enqueue_completion(ProbeCompletion &&completion);
+
+    // Worker only, queued probes that are done with
+    void release_queued(int count);
+
+    void signal_idle();
+
+    // Caller holds the reactor delivery_mutex
+    bool has_delivery() const;
+
+    // Caller holds the reactor delivery_mutex
+    void take_delivery(DeliveryBatch &batch);
+
+    void deliver(DeliveryBatch &batch);
+
+    void send_callbacks(std::vector<ProbeCompletion> &batch);
+
+    void send_results(std::vector<ProbeCompletion> &batch);
+
+    bool write_result(const ProbeCompletion &completion);
+
+    void flush_results();
 
     void force_timeouts();
 
-    int get_min_wait_time();
+    int64_t get_min_wait_time();
 
     void read_data(int fd);
 
-    void wakeup_event() const;
+    void read_probe_data(int fd, ProbeContext &probe, ProbeDetails &details);
+
+    void read_shared_data(SharedSocket &socket);
+
+    void read_shared_message(SharedSocket &socket, mmsghdr &message, bool reply, const ClockSample &now);
+
+    bool parse_control(msghdr &msg, ProbeContext &probe, ProbeDetails &details, const ClockSample &now) const;
+
+    static bool parse_tx_timestamp(msghdr &msg, KernelTimestamps &stamps, uint32_t &tx_id);
+
+    static KernelTimestamps parse_timestamping(const cmsghdr *cmsg);
+
+    void match_tx_timestamp(SharedSocket &socket, uint32_t tx_id, const KernelTimestamps &stamps);
+
+    static int64_t probe_elapsed_ns(const ProbeContext &probe);
+
+    // Bytes received of a reply to a probe of packet_size
+    size_t reply_buffer_size(size_t packet_size) const;
+
+    void store_reply(ProbeContext &probe, ProbeDetails &details, const uint8_t *data, size_t data_len,
+                     int msg_flags) const;
+
+    static bool parse_echo_sequence(int family, const uint8_t *data, ssize_t data_len, bool reply, uint16_t &sequence);
+
+    // False once the manager is stopped, nothing may be submitted then. Paired with end_submission().
+    bool begin_submission();
 
-    void setup_epoll();
+    void end_submission();
 
-    void handler();
+    // Caller cleared running, returns once no sender is inside a submission
+    void wait_submissions();
+
+    // Undoes the count of submissions that never reached the queue, caller is inside a submission
+    void rollback_queued(int count);
+
+    // Stop, cancel and other submissions without a result of their own
+    int submit_control(ProbeSubmission &&submission);
+
+    void notify_worker();
+
+    // Worker only, turns a rollback that emptied the queue into an idle signal
+    void check_idle_request();
+
+    // Steps of the reactor loop, submissions before waiting and the rest after reading replies
+    void begin_pass();
+
+    void end_pass();
+
+    // Resolves everything left once the manager is detached
+    void shutdown();
 
 public:
 
-    explicit ProbeManager(const char *remote_ip, const char *source_ip, void *callback_obj, JNICallback trigger_callback);
+    explicit ProbeManager(const char *remote_ip, const char *source_ip, const ManagerOptions &options,
+                          void *callback_obj, JNICallback trigger_callback,
+                          JNIResultsCallback trigger_results = nullptr, JNIIdleCallback trigger_idle = nullptr,
+                          JNISessionEndCallback trigger_session_end = nullptr,
+                          JNIReleasedCallback trigger_released = nullptr);
 
-    void start();
+    // Attaches to the shared reactor, starting it on first use. False if the manager cannot run.
+    bool start();
 
+    // Returns once the remaining completions are delivered
     void stop();
 
+    // Stops the manager and runs release once it is safe to free it. Deferred to the delivery
+    // thread when called from a callback.
+    void dispose(std::function<void()> release);
+
+    // Returns a pattern id for send_probe, SEND_PROBE_ERROR once MAX_PATTERNS are registered
+    int register_pattern(const char *pattern, int pattern_len);
+
+    // nullptr for an unknown pattern id
+    ProbePattern find_pattern(int pattern_id);
+
+    // Returns a target id for ProbeRequest::target, SEND_PROBE_ERROR for an invalid address or once
+    // MAX_TARGETS are registered. IPv4 and IPv6 targets can be mixed.
+    int register_target(const char *ip);
+
     int
-    send_probe(int id, ProbeType probe_type, int port, int sequence, int ttl, int timeout, int size, bool detect_mtu,
-               char *pattern, int pattern_len);
+    send_probe(int id, ProbeType probe_type, int port, int sequence, int ttl, int64_t timeout_us, int size, bool detect_mtu,
+               int pattern_id, int target = PRIMARY_TARGET);
+
+    std::vector<int> send_probes_batch(const std::vector<ProbeRequest> &requests, int pattern_id);
+
+    // Sends probes as the schedule says, starting right away. Sequences count up from the
+    // request's one, every result carries the request id.
+    int start_session(const ProbeRequest &request, int pattern_id, const SessionSchedule &schedule);
+
+    // False for an unknown session
+    bool get_session_stats(int id, SessionStatsSnapshot &snapshot);
+
+    // Probes already sent are still reported
+    int stop_session(int id);
+
+    // Walks the hops as the plan says, starting right away. The request gives the id of hop 1,
+    // probe type, timeout, initial size and whether the size shrinks to the path MTU.
+    int start_trace(const ProbeRequest &request, int pattern_id, const TracePlan &plan);
+
+    // Probes already sent are still reported
+    int stop_trace(int id);
+
+    // Matching probes release their sockets and slots without waiting for the timeout.
+    // Applies to what was submitted before, including probes still in the submission queue.
+    int cancel(const CancelFilter &filter);
 
     int get_queue_size();
 
+    uint64_t get_dropped_count() const { return dropped.load(); }
+
     void *get_callback_obj() { return callback_obj; }
+
+    // nullptr unless results are delivered through the ring
+    ResultRing *get_result_ring() { return result_ring.get(); }
 };
 
 
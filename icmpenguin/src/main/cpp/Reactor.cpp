@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "Reactor.h"
+#include "ProbeManager.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utility>
+#include <android/log_macros.h>
+
+namespace {
+thread_local bool delivery_thread = false;
+}
+
+Reactor *Reactor::get() {
+    // Leaked on purpose, joining the threads from a static destructor would hang the exit
+    static Reactor *reactor = new Reactor();
+    return reactor;
+}
+
+void Reactor::start() {
+    poller = create_poller();
+    if (poller == nullptr) {
+        ALOGE("Error setting up poller");
+        return;
+    }
+    wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    if (wakeup_fd < 0) {
+        ALOGE("Error creating wakeup fd: %d %s", errno, strerror(errno));
+        poller.reset();
+        return;
+    }
+    poller->add(wakeup_fd);
+    worker = std::thread(&Reactor::handler, this);
+    started = true;
+}
+
+bool Reactor::attach(ProbeManager *manager) {
+    std::call_once(start_flag, [this] { start(); });
+    if (!started)
+        return false;
+    {
+        std::lock_guard lock(members_mutex);
+        joining.push_back(manager);
+    }
+    notify();
+    return true;
+}
+
+void Reactor::detach(ProbeManager *manager) {
+    {
+        std::lock_guard lock(members_mutex);
+        leaving.push_back(manager);
+    }
+    notify();
+    // Whatever the worker handed over is still delivered
+    std::unique_lock lock(delivery_mutex);
+    delivery_done.wait(lock, [this, manager] { return is_drained(manager); });
+}
+
+void Reactor::detach_later(ProbeManager *manager, std::function<void()> release) {
+    {
+        std::lock_guard lock(members_mutex);
+        leaving.push_back(manager);
+    }
+    notify();
+    std::lock_guard lock(delivery_mutex);
+    releasing.emplace_back(manager, std::move(release));
+}
+
+bool Reactor::on_delivery_thread() const {
+    return delivery_thread;
+}
+
+bool Reactor::is_drained(const ProbeManager *manager) const {
+    return manager->detached && !manager->delivery_listed && !manager->delivering;
+}
+
+void Reactor::run_releases(std::unique_lock<std::mutex> &lock) {
+    auto due = std::partition(releasing.begin(), releasing.end(),
+                              [this](const auto &entry) { return !is_drained(entry.first); });
+    if (due == releasing.end())
+        return;
+    std::vector<std::function<void()>> releases;
+    for (auto it = due; it != releasing.end(); ++it)
+        releases.push_back(std::move(it->second));
+    releasing.erase(due, releasing.end());
+    lock.unlock();
+    for (auto &release: releases)
+        release();
+    lock.lock();
+}
+
+void Reactor::notify() {
+    work_pending.store(true);
+    // A busy worker goes through the managers again before parking, only a parked one needs the eventfd
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.exchange(false))
+        wakeup_event();
+}
+
+void Reactor::wakeup_event() const {
+    int64_t one = 1;
+    write(wakeup_fd, &one, sizeof(one));
+}
+
+void Reactor::schedule_delivery(ProbeManager *manager) {
+    // A manager being delivered is listed again by its delivery thread
+    if (manager->delivery_listed || manager->delivering)
+        return;
+    manager->delivery_listed = true;
+    delivery_order.push_back(manager);
+    if (delivery_order.size() > idle_deliverers && deliverers.size() < DELIVERY_THREADS_MAX)
+        deliverers.emplace_back(&Reactor::deliverer, this);
+}
+
+void Reactor::watch(int fd, ProbeManager *owner) {
+    if (fd >= static_cast<int>(fd_owners.size()))
+        fd_owners.resize(fd + 1, nullptr);
+    fd_owners[fd] = owner;
+    poller->add(fd);
+}
+
+void Reactor::unwatch(int fd) {
+    poller->remove(fd);
+    fd_owners[fd] = nullptr;
+}
+
+void Reactor::update_members() {
+    std::vector<ProbeManager *> left;
+    {
+        std::lock_guard lock(members_mutex);
+        managers.insert(managers.end(), joining.begin(), joining.end());
+        joining.clear();
+        if (leaving.empty())
+            return;
+        left.swap(leaving);
+    }
+    for (auto *manager: left) {
+        manager->shutdown();
+        managers.erase(std::find(managers.begin(), managers.end(), manager));
+    }
+    {
+        // Nothing is scheduled for the manager past this point
+        std::lock_guard lock(delivery_mutex);
+        for (auto *manager: left)
+            manager->detached = true;
+    }
+    delivery_done.notify_all();
+    delivery_ready.notify_one();
+}
+
+// Worker thread
+void Reactor::handler() {
+    // Also the name the thread is attached to the JVM under
+    pthread_setname_np(pthread_self(), WORKER_THREAD_NAME);
+    int fds[POLLER_MAX_EVENTS];
+    while (true) {
+        // Cleared before the pass, anything submitted or detached later is seen before parking
+        work_pending.exchange(false);
+        update_members();
+        int64_t wait_time = -1;
+        for (auto *manager: managers) {
+            manager->begin_pass();
+            int64_t manager_wait = manager->get_min_wait_time();
+            if (manager_wait >= 0 && (wait_time < 0 || manager_wait < wait_time))
+                wait_time = manager_wait;
+        }
+        parked.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Submitted while the worker was busy, producers saw it unparked and did not wake it
+        if (work_pending.load())
+            wait_time = 0;
+        int n = poller->wait(fds, POLLER_MAX_EVENTS, wait_time);
+        parked.store(false);
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == wakeup_fd) {
+                uint64_t ev;
+                read(wakeup_fd, &ev, sizeof(ev));
+                continue;
+            }
+            // A socket closed earlier in the pass may still be reported
+            auto *owner = fds[i] < static_cast<int>(fd_owners.size()) ? fd_owners[fds[i]] : nullptr;
+            if (owner != nullptr)
+                owner->read_data(fds[i]);
+        }
+        for (auto *manager: managers)
+            manager->end_pass();
+    }
+}
+
+// Delivery threads, the only ones calling back into Kotlin for completed probes
+void Reactor::deliverer() {
+    pthread_setname_np(pthread_self(), DELIVERY_THREAD_NAME);
+    delivery_thread = true;
+    DeliveryBatch batch;
+    std::unique_lock lock(delivery_mutex);
+    while (true) {
+        idle_deliverers++;
+        delivery_ready.wait(lock, [this] {
+            return !delivery_order.empty() ||
+                   std::any_of(releasing.begin(), releasing.end(),
+                               [this](const auto &entry) { return is_drained(entry.first); });
+        });
+        idle_deliverers--;
+        run_releases(lock);
+        if (delivery_order.empty())
+            continue;
+        auto *manager = delivery_order.front();
+        delivery_order.pop_front();
+        // The others are for idle threads, the producer only woke one
+        if (!delivery_order.empty())
+            delivery_ready.notify_one();
+        manager->delivery_listed = false;
+        manager->delivering = true;
+        manager->take_delivery(batch);
+        // The worker held this manager back while its queue was full
+        bool resume = manager->delivery_held.exchange(false);
+        lock.unlock();
+        if (resume)
+            notify();
+        manager->deliver(batch);
+        batch.clear();
+        lock.lock();
+        manager->delivering = false;
+        // Completed while its callbacks ran, left for this thread to keep them in order
+        if (manager->has_delivery())
+            schedule_delivery(manager);
+        delivery_done.notify_all();
+    }
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_REACTOR_H
+#define ICMPENGUIN_REACTOR_H
+
+#import <atomic>
+#import <condition_variable>
+#import <deque>
+#import <functional>
+#import <memory>
+#import <mutex>
+#import <thread>
+#import <vector>
+#import "Poller.h"
+
+// Managers delivered at the same time, as many slow callbacks hold up nobody else
+#define DELIVERY_THREADS_MAX 4
+
+class ProbeManager;
+
+// Worker and delivery threads shared by every manager. A manager only owns its sockets and
+// probe state, the worker steps all attached managers in one loop. Started by the first
+// manager and kept for the lifetime of the process, attaching is cheap afterwards.
+class Reactor {
+private:
+    std::unique_ptr<Poller> poller;
+    int wakeup_fd = -1;
+    std::once_flag start_flag;
+    bool started = false;
+    std::thread worker;
+    // Started as managers wait for delivery with none idle, each delivers one manager at a time
+    std::vector<std::thread> deliverers;
+    size_t idle_deliverers = 0;
+    // Set while the worker may block in the poller, notify() only writes the eventfd then
+    std::atomic<bool> parked{false};
+    // Something was submitted since the worker last went through the managers
+    std::atomic<bool> work_pending{false};
+
+    // Worker only
+    std::vector<ProbeManager *> managers;
+    // Manager owning each socket in the poller, indexed by fd
+    std::vector<ProbeManager *> fd_owners;
+
+    // Managers handed to the worker and taken back from it
+    std::mutex members_mutex;
+    std::vector<ProbeManager *> joining;
+    std::vector<ProbeManager *> leaving;
+
+    // Managers with completions or an idle signal to deliver, in the order they got them.
+    // One being delivered is listed again afterwards, so its callbacks never run concurrently.
+    std::deque<ProbeManager *> delivery_order;
+    // Managers closed from callbacks, released by a delivery thread once drained
+    std::vector<std::pair<ProbeManager *, std::function<void()>>> releasing;
+
+    Reactor() = default;
+
+    void start();
+
+    void wakeup_event() const;
+
+    void update_members();
+
+    void handler();
+
+    void deliverer();
+
+    // Caller holds delivery_mutex
+    bool is_drained(const ProbeManager *manager) const;
+
+    // Delivery thread, runs the releases that are due with the lock dropped
+    void run_releases(std::unique_lock<std::mutex> &lock);
+
+public:
+    // Guards the delivery queues of all managers
+    std::mutex delivery_mutex;
+    std::condition_variable delivery_ready;
+    std::condition_variable delivery_done;
+
+    // Never destroyed, the threads keep running until the process exits
+    static Reactor *get();
+
+    // Starts the threads on first use. False when the poller could not be set up.
+    bool attach(ProbeManager *manager);
+
+    // Returns once the worker let go of the manager and its completions are delivered
+    void detach(ProbeManager *manager);
+
+    // For delivery threads, which may wait for themselves. Runs release once detach would have returned.
+    void detach_later(ProbeManager *manager, std::function<void()> release);
+
+    bool on_delivery_thread() const;
+
+    void notify();
+
+    // Caller holds delivery_mutex
+    void schedule_delivery(ProbeManager *manager);
+
+    // Worker only
+    void watch(int fd, ProbeManager *owner);
+
+    void unwatch(int fd);
+};
+
+#endif //ICMPENGUIN_REACTOR_H
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_RESULTRING_H
+#define ICMPENGUIN_RESULTRING_H
+
+#import <algorithm>
+#import <cstddef>
+#import <cstdint>
+#import <cstring>
+#import <memory>
+
+#define RESULT_RING_SIZE (256 * 1024)
+#define RESULT_RECORD_ALIGN 8
+// Fits INET6_ADDRSTRLEN with the terminating zero
+#define RESULT_OFFENDER_SIZE 48
+
+// Mirrored by ResultRing.kt
+enum class ResultKind : int32_t {
+    PADDING = -1,
+    SUCCESS = 0,
+    TIMEOUT = 1,
+    CONNECTION_REFUSED = 2,
+    HOST_UNREACHABLE = 3,
+    NET_UNREACHABLE = 4,
+    NET_ERROR = 5,
+    UNKNOWN = 6,
+};
+
+// Fixed part of a record, followed by payload_len bytes of payload: reply data for SUCCESS,
+// the UTF-8 error message for UNKNOWN. Fields are in native byte order, the layout is mirrored
+// by ResultRing.kt.
+struct ResultRecord {
+    // Whole record including payload and padding
+    int32_t length;
+    ResultKind kind;
+    int32_t id;
+    // Target id, ResultRing.kt maps it back to the address
+    int32_t target;
+    int32_t sequence;
+    int32_t probe_size;
+    int32_t overhead;
+    int32_t elapsed_us;
+    int32_t ttl;
+    int32_t err_no;
+    int32_t err_code;
+    int32_t err_type;
+    int32_t err_info;
+    int32_t payload_len;
+    // Whole reply, the payload may hold less of it
+    int32_t reply_size;
+    // CRC32 of the echoed payload, -1 when not computed
+    int64_t reply_crc;
+    // Zero terminated
+    char offender[RESULT_OFFENDER_SIZE];
+};
+
+static_assert(sizeof(ResultRecord) == 120, "ResultRecord layout is shared with Kotlin");
+
+// Byte ring of result records, written by the worker and read by Kotlin through a direct
+// ByteBuffer over the same memory. A record never wraps, the tail of the buffer is skipped
+// with a PADDING record instead. The consumer learns positions from the upcall and the ring
+// learns what was consumed from release(), neither side reads the other's position.
+class ResultRing {
+private:
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t size;
+    size_t write_pos = 0;
+    size_t read_pos = 0;
+    size_t used = 0;
+
+    static size_t align(size_t length) {
+        return (length + RESULT_RECORD_ALIGN - 1) & ~static_cast<size_t>(RESULT_RECORD_ALIGN - 1);
+    }
+
+    // Kept below the size, a full ring would look the same as an empty one
+    bool fits(size_t length) const { return used + length < size; }
+
+public:
+    explicit ResultRing(size_t size = RESULT_RING_SIZE) : buffer(std::make_unique<uint8_t[]>(size)), size(size) {}
+
+    uint8_t *data() { return buffer.get(); }
+
+    size_t capacity() const { return size; }
+
+    size_t write_position() const { return write_pos; }
+
+    size_t read_position() const { return read_pos; }
+
+    // Fills in length and payload_len. Returns false when the ring has no room until released.
+    bool write(ResultRecord &record, const void *payload, size_t payload_len) {
+        size_t length = align(sizeof(ResultRecord) + payload_len);
+        size_t tail = size - write_pos;
+        size_t padding = length > tail ? tail : 0;
+        if (!fits(padding + length))
+            return false;
+        if (padding > 0) {
+            ResultRecord skip{
+                    .length = static_cast<int32_t>(padding),
+                    .kind = ResultKind::PADDING,
+            };
+            // The tail is aligned, there is always room for length and kind
+            memcpy(buffer.get() + write_pos, &skip, std::min(padding, sizeof(skip)));
+            write_pos = 0;
+            used += padding;
+        }
+        record.length = static_cast<int32_t>(length);
+        record.payload_len = static_cast<int32_t>(payload_len);
+        auto *dst = buffer.get() + write_pos;
+        memcpy(dst, &record, sizeof(record));
+        if (payload_len > 0)
+            memcpy(dst + sizeof(record), payload, payload_len);
+        write_pos += length;
+        if (write_pos == size)
+            write_pos = 0;
+        used += length;
+        return true;
+    }
+
+    // Everything up to pos has been consumed
+    void release(size_t pos) {
+        used -= (pos + size - read_pos) % size;
+        read_pos = pos;
+    }
+};
+
+#endif //ICMPENGUIN_RESULTRING_H
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_SESSIONSTATS_H
+#define ICMPENGUIN_SESSIONSTATS_H
+
+#import <algorithm>
+#import <array>
+#import <atomic>
+#import <cstdint>
+
+// Log-linear RTT histogram in microseconds: exact below RTT_LINEAR_LIMIT, then RTT_SUB_BUCKETS
+// buckets per power of two, which keeps percentiles within about 6%
+#define RTT_SUB_BUCKET_BITS 4
+#define RTT_SUB_BUCKETS (1 << RTT_SUB_BUCKET_BITS)
+#define RTT_LINEAR_LIMIT RTT_SUB_BUCKETS
+#define RTT_MAX_BITS 32
+#define RTT_BUCKETS (RTT_LINEAR_LIMIT + (RTT_MAX_BITS - RTT_SUB_BUCKET_BITS) * RTT_SUB_BUCKETS)
+
+// Point-in-time copy of SessionStats, times in microseconds
+struct SessionStatsSnapshot {
+    int64_t sent;
+    int64_t received;
+    int64_t lost;
+    int64_t errors;
+    // From the first send to the last one, or to now while the session runs
+    int64_t duration_us;
+    int64_t rtt_min_us;
+    int64_t rtt_avg_us;
+    int64_t rtt_max_us;
+    int64_t rtt_p50_us;
+    int64_t rtt_p90_us;
+    int64_t rtt_p99_us;
+};
+
+// Counters of a ping session. The worker is the only writer, so plain loads and stores
+// suffice, readers on other threads see each counter on its own without tearing.
+class SessionStats {
+private:
+    std::atomic<int64_t> sent{0};
+    std::atomic<int64_t> received{0};
+    std::atomic<int64_t> lost{0};
+    std::atomic<int64_t> errors{0};
+    std::atomic<int64_t> first_send_ns{0};
+    std::atomic<int64_t> last_send_ns{0};
+    std::atomic<bool> finished{false};
+    std::atomic<int64_t> rtt_min_us{INT64_MAX};
+    std::atomic<int64_t> rtt_max_us{0};
+    std::atomic<int64_t> rtt_sum_us{0};
+    std::array<std::atomic<uint32_t>, RTT_BUCKETS> rtt_histogram{};
+
+    template<typename T>
+    static void add(std::atomic<T> &counter, T value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static size_t bucket(int64_t rtt_us) {
+        auto value = static_cast<uint64_t>(std::max(rtt_us, static_cast<int64_t>(0)));
+        if (value < RTT_LINEAR_LIMIT)
+            return static_cast<size_t>(value);
+        int bits = 63 - __builtin_clzll(value);
+        if (bits >= RTT_MAX_BITS)
+            return RTT_BUCKETS - 1;
+        int shift = bits - RTT_SUB_BUCKET_BITS;
+        auto sub = static_cast<size_t>((value >> shift) & (RTT_SUB_BUCKETS - 1));
+        return RTT_LINEAR_LIMIT + static_cast<size_t>(shift) * RTT_SUB_BUCKETS + sub;
+    }
+
+    // Middle of the range covered by a bucket
+    static int64_t bucket_value(size_t index) {
+        if (index < RTT_LINEAR_LIMIT)
+            return static_cast<int64_t>(index);
+        size_t shift = (index - RTT_LINEAR_LIMIT) / RTT_SUB_BUCKETS;
+        size_t sub = (index - RTT_LINEAR_LIMIT) % RTT_SUB_BUCKETS;
+        int64_t low = static_cast<int64_t>(RTT_SUB_BUCKETS + sub) << shift;
+        return low + ((static_cast<int64_t>(1) << shift) >> 1);
+    }
+
+    static int64_t percentile(const std::array<uint32_t, RTT_BUCKETS> &histogram, int64_t total, int percent) {
+        if (total == 0)
+            return 0;
+        int64_t rank = (total * percent + 99) / 100;
+        int64_t seen = 0;
+        for (size_t i = 0; i < RTT_BUCKETS; i++) {
+            seen += histogram[i];
+            if (seen >= rank)
+                return bucket_value(i);
+        }
+        return bucket_value(RTT_BUCKETS - 1);
+    }
+
+public:
+    void on_sent(int64_t now_ns) {
+        if (sent.load(std::memory_order_relaxed) == 0)
+            first_send_ns.store(now_ns, std::memory_order_relaxed);
+        last_send_ns.store(now_ns, std::memory_order_relaxed);
+        add(sent, static_cast<int64_t>(1));
+    }
+
+    void on_received(int64_t rtt_us) {
+        add(received, static_cast<int64_t>(1));
+        add(rtt_sum_us, rtt_us);
+        if (rtt_us < rtt_min_us.load(std::memory_order_relaxed))
+            rtt_min_us.store(rtt_us, std::memory_order_relaxed);
+        if (rtt_us > rtt_max_us.load(std::memory_order_relaxed))
+            rtt_max_us.store(rtt_us, std::memory_order_relaxed);
+        add(rtt_histogram[bucket(rtt_us)], 1u);
+    }
+
+    void on_lost() { add(lost, static_cast<int64_t>(1)); }
+
+    void on_error() { add(errors, static_cast<int64_t>(1)); }
+
+    // No more sends, the duration stops growing
+    void finish() { finished.store(true, std::memory_order_relaxed); }
+
+    SessionStatsSnapshot snapshot(int64_t now_ns) const {
+        SessionStatsSnapshot result{
+                .sent = sent.load(std::memory_order_relaxed),
+                .received = received.load(std::memory_order_relaxed),
+                .lost = lost.load(std::memory_order_relaxed),
+                .errors = errors.load(std::memory_order_relaxed),
+        };
+        if (result.sent > 0) {
+            int64_t end_ns = finished.load(std::memory_order_relaxed)
+                             ? last_send_ns.load(std::memory_order_relaxed) : now_ns;
+            result.duration_us = (end_ns - first_send_ns.load(std::memory_order_relaxed)) / 1000;
+        }
+        std::array<uint32_t, RTT_BUCKETS> histogram{};
+        int64_t total = 0;
+        for (size_t i = 0; i < RTT_BUCKETS; i++) {
+            histogram[i] = rtt_histogram[i].load(std::memory_order_relaxed);
+            total += histogram[i];
+        }
+        if (total > 0) {
+            result.rtt_min_us = rtt_min_us.load(std::memory_order_relaxed);
+            result.rtt_max_us = rtt_max_us.load(std::memory_order_relaxed);
+            result.rtt_avg_us = rtt_sum_us.load(std::memory_order_relaxed) / std::max(result.received, static_cast<int64_t>(1));
+            result.rtt_p50_us = percentile(histogram, total, 50);
+            result.rtt_p90_us = percentile(histogram, total, 90);
+            result.rtt_p99_us = percentile(histogram, total, 99);
+        }
+        return result;
+    }
+};
+
+#endif //ICMPENGUIN_SESSIONSTATS_H
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef ICMPENGUIN_SLAB_H
+#define ICMPENGUIN_SLAB_H
+
+#import <algorithm>
+#import <array>
+#import <cstdint>
+#import <memory>
+
+#define SLAB_INDEX_BITS 16
+#define SLAB_CAPACITY (1u << SLAB_INDEX_BITS)
+#define SLAB_CHUNK_SIZE 256
+
+// Slot index in the low bits, slot generation in the high ones. 0 is never handed out.
+using SlabHandle = uint32_t;
+#define INVALID_HANDLE 0u
+
+// Fixed capacity pool addressed by generational handles. Each slot pairs an object checked
+// on every event with a cold one only touched when it is sent or resolves, stored apart so
+// scans stay within the small ones. Everything lives in chunks that never move, references stay
+// valid while other slots are allocated. Released objects are not destroyed and keep their
+// buffers for the next user. Not thread safe.
+template<typename T, typename Cold>
+class Slab {
+private:
+    struct Slot {
+        uint16_t generation = 1;
+        bool in_use = false;
+        uint32_t next_free = SLAB_CAPACITY;
+    };
+
+    struct Chunk {
+        std::array<Slot, SLAB_CHUNK_SIZE> slots;
+        std::array<T, SLAB_CHUNK_SIZE> objects;
+        std::array<Cold, SLAB_CHUNK_SIZE> cold;
+    };
+
+    std::array<std::unique_ptr<Chunk>, SLAB_CAPACITY / SLAB_CHUNK_SIZE> chunks;
+    // Slots handed out at least once, all of them below this index
+    uint32_t created = 0;
+    // Free slots are reused oldest first, which spreads generations across the slab
+    uint32_t free_head = SLAB_CAPACITY;
+    uint32_t free_tail = SLAB_CAPACITY;
+    size_t used = 0;
+
+    Chunk &chunk(uint32_t index) { return *chunks[index / SLAB_CHUNK_SIZE]; }
+
+    Slot &slot(uint32_t index) { return chunk(index).slots[index % SLAB_CHUNK_SIZE]; }
+
+    static SlabHandle make_handle(uint32_t index, uint16_t generation) {
+        return (static_cast<SlabHandle>(generation) << SLAB_INDEX_BITS) | index;
+    }
+
+    // Index of a live slot, SLAB_CAPACITY for stale or invalid handles
+    uint32_t find(SlabHandle handle) {
+        uint32_t index = handle & (SLAB_CAPACITY - 1);
+        if (index >= created)
+            return SLAB_CAPACITY;
+        auto &entry = slot(index);
+        if (!entry.in_use || entry.generation != handle >> SLAB_INDEX_BITS)
+            return SLAB_CAPACITY;
+        return index;
+    }
+
+public:
+    // Chunks for the first reserve slots are allocated up front, later ones when first needed
+    explicit Slab(size_t reserve = SLAB_CHUNK_SIZE) {
+        size_t count = std::clamp<size_t>((reserve + SLAB_CHUNK_SIZE - 1) / SLAB_CHUNK_SIZE, 1, chunks.size());
+        for (size_t i = 0; i < count; i++)
+            chunks[i] = std::make_unique<Chunk>();
+    }
+
+    // Returns INVALID_HANDLE when the slab is full
+    SlabHandle allocate() {
+        uint32_t index;
+        if (free_head != SLAB_CAPACITY) {
+            index = free_head;
+            free_head = slot(index).next_free;
+            if (free_head == SLAB_CAPACITY)
+                free_tail = SLAB_CAPACITY;
+        } else if (created < SLAB_CAPACITY) {
+            index = created++;
+            auto &next = chunks[index / SLAB_CHUNK_SIZE];
+            if (next == nullptr)
+                next = std::make_unique<Chunk>();
+        } else {
+            return INVALID_HANDLE;
+        }
+        auto &entry = slot(index);
+        entry.in_use = true;
+        used++;
+        return make_handle(index, entry.generation);
+    }
+
+    // nullptr for stale or invalid handles
+    T *get(SlabHandle handle) {
+        uint32_t index = find(handle);
+        if (index == SLAB_CAPACITY)
+            return nullptr;
+        return &chunk(index).objects[index % SLAB_CHUNK_SIZE];
+    }
+
+    // nullptr for stale or invalid handles
+    Cold *get_cold(SlabHandle handle) {
+        uint32_t index = find(handle);
+        if (index == SLAB_CAPACITY)
+            return nullptr;
+        return &chunk(index).cold[index % SLAB_CHUNK_SIZE];
+    }
+
+    void release(SlabHandle handle) {
+        uint32_t index = find(handle);
+        if (index == SLAB_CAPACITY)
+            return;
+        auto &entry = slot(index);
+        entry.in_use = false;
+        // Generation 0 would make handle 0 valid
+        if (++entry.generation == 0)
+            entry.generation = 1;
+        entry.next_free = SLAB_CAPACITY;
+        if (free_tail == SLAB_CAPACITY) {
+            free_head = index;
+        } else {
+            slot(free_tail).next_free = index;
+        }
+        free_tail = index;
+        used--;
+    }
+
+    size_t size() const { return used; }
+
+    template<typename F>
+    void for_each(F &&f) {
+        for (uint32_t i = 0; i < created; i++) {
+            auto &entry = slot(i);
+            if (entry.in_use)
+                f(make_handle(i, entry.generation), chunk(i).objects[i % SLAB_CHUNK_SIZE]);
+        }
+    }
+};
+
+#endif //ICMPENGUIN_SLAB_H
@@ -40,7 +40,7 @@ JNIMethodInfo JNI_methods[] = {
                 .cls = nullptr,
                 .class_name = "me/impa/icmpenguin/ProbeResult$Success",
                 .method_name = "<init>",
-                .method_sig = "(ILjava/lang/String;IIII[B)V"
+                .method_sig = "(ILjava/lang/String;IIII[BIJ)V"
         }, {
                 .mid = nullptr,
                 .cls = nullptr,
@@ -77,6 +77,30 @@ JNIMethodInfo JNI_methods[] = {
                 .class_name = "me/impa/icmpenguin/ProbeResult$Unknown",
                 .method_name = "<init>",
                 .method_sig = "(ILjava/lang/String;IILjava/lang/String;)V"
+        }, {
+                .mid = nullptr,
+                .cls = nullptr,
+                .class_name = "me/impa/icmpenguin/ProbeManager",
+                .method_name = "resultsCallback",
+                .method_sig = "(II)V"
+        }, {
+                .mid = nullptr,
+                .cls = nullptr,
+                .class_name = "me/impa/icmpenguin/ProbeManager",
+                .method_name = "idleCallback",
+                .method_sig = "()V"
+        }, {
+                .mid = nullptr,
+                .cls = nullptr,
+                .class_name = "me/impa/icmpenguin/ProbeManager",
+                .method_name = "releasedCallback",
+                .method_sig = "([I)V"
+        }, {
+                .mid = nullptr,
+                .cls = nullptr,
+                .class_name = "me/impa/icmpenguin/ProbeManager",
+                .method_name = "sessionEndCallback",
+                .method_sig = "(II[J)V"
         }
 };
 
@@ -100,6 +124,10 @@ JNIMethodInfo JNI_methods[] = {
 #define RESULT_NET_ERROR_CLS JNI_METHOD_CLS(6)
 #define RESULT_UNKNOWN_MID JNI_METHOD_MID(7)
 #define RESULT_UNKNOWN_CLS JNI_METHOD_CLS(7)
+#define RESULTS_CALLBACK_MID JNI_METHOD_MID(8)
+#define IDLE_CALLBACK_MID JNI_METHOD_MID(9)
+#define RELEASED_CALLBACK_MID JNI_METHOD_MID(10)
+#define SESSION_END_CALLBACK_MID JNI_METHOD_MID(11)
 
 
 #endif //ICMPENGUIN_JNI_METHODS_H
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+package me.impa.icmpenguin
+
+/**
+ * What the native worker does when results are produced faster than callbacks consume them, that is once
+ * 4096 results of a manager wait for delivery.
+ *
+ * @property code The integer code passed to the native side.
+ */
+enum class Backpressure(val code: Int) {
+    /**
+     * Wait for the callbacks to catch up. Nothing is lost, new probes of the manager are held back meanwhile.
+     * Results of probes already in flight are still queued, so the 4096 are a threshold rather than a bound.
+     */
+    BLOCK(0),
+    /**
+     * Discard the result and count it. Callbacks of dropped probes are never invoked.
+     */
+    DROP(1)
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+package me.impa.icmpenguin
+
+/**
+ * How much of an echo reply ends up in [ProbeResult.Success.data].
+ *
+ * Anything but [Full] also limits what the kernel copies out of the socket. [ProbeResult.Success.dataSize]
+ * always reports the size of the whole reply.
+ *
+ * @property code The integer code passed to the native side.
+ */
+sealed class PayloadMode(val code: Int) {
+    /**
+     * The whole reply, including the ICMP header.
+     */
+    data object Full : PayloadMode(0)
+
+    /**
+     * No data at all.
+     */
+    data object None : PayloadMode(1)
+
+    /**
+     * The first [bytes] bytes of the reply.
+     */
+    data class Truncated(val bytes: Int) : PayloadMode(2)
+
+    /**
+     * No data, [ProbeResult.Success.dataCrc] holds the CRC32 of the echoed payload instead, as computed
+     * by [java.util.zip.CRC32] over the bytes following the ICMP header.
+     */
+    data object Checksum : PayloadMode(3)
+
+    internal val limit: Int
+        get() = if (this is Truncated) bytes else 0
+}
@@ -21,55 +21,153 @@ import android.system.OsConstants.EMSGSIZE
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.SupervisorJob
-import kotlinx.coroutines.delay
+import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.first
+import kotlinx.coroutines.flow.update
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.runBlocking
+import me.impa.icmpenguin.ping.PingStatistics
+import me.impa.icmpenguin.trace.PortStrategy
+import me.impa.icmpenguin.trace.TraceStrategy
 import java.lang.System.loadLibrary
 import java.net.InetAddress
+import java.nio.ByteBuffer
+import java.util.concurrent.ConcurrentHashMap
+import java.util.concurrent.atomic.AtomicBoolean
 import java.util.concurrent.atomic.AtomicInteger
 
-internal class ProbeManager(host: String, sourceIp: String = "") : AutoCloseable {
+private typealias ProbeHandler = suspend (probeId: Int, result: ProbeResult) -> Unit
+
+/**
+ * Native probe manager created for a remote host.
+ *
+ * Managers are cheap to create: they only hold sockets and probe state, and share one native worker.
+ * More targets can be added with [registerTarget], so one manager and its sockets can sweep many hosts.
+ * IPv4 and IPv6 targets may be mixed.
+ *
+ * @param host The remote host address, probes go there unless they name another target.
+ * @param sourceIp The source IP address to bind to. If empty, the system chooses automatically.
+ * @param sharedSockets If true, ICMP probes are multiplexed over one long-lived socket instead of
+ *   opening a socket per probe. UDP probes always use a dedicated socket.
+ * @param kernelTimestamps If true, round-trip times are taken from kernel TX/RX timestamps
+ *   (`SO_TIMESTAMPING`), leaving out the scheduling of the native worker.
+ * @param resultRing If true, the native worker writes results into a buffer shared with Kotlin and
+ *   signals once per batch. Result objects are only built for probes that still have a callback.
+ * @param backpressure What to do when callbacks fall behind. Callbacks run on a native thread shared
+ *   by all managers. [Backpressure.BLOCK] only holds back new probes of the manager that fell behind.
+ * @param payloadMode How much of echo replies is delivered in [ProbeResult.Success.data].
+ */
+internal class ProbeManager(
+    host: String,
+    sourceIp: String = "",
+    sharedSockets: Boolean = true,
+    kernelTimestamps: Boolean = true,
+    resultRing: Boolean = false,
+    backpressure: Backpressure = Backpressure.BLOCK,
+    payloadMode: PayloadMode = PayloadMode.Full
+) : AutoCloseable {
 
     private val instance: Long
 
+    private val resultRing: ResultRing?
+
     private val scope = CoroutineScope(Dispatchers.Default + SupervisorJob())
 
-    private val callbacks = mutableMapOf<Int, suspend (ProbeResult) -> Unit>()
+    private val callbacks = ConcurrentHashMap<Int, ProbeHandler>()
+
+    // Ping sessions and trace hops. Unlike callbacks these receive many results and stay until the session ends
+    private val sessions = ConcurrentHashMap<Int, ProbeHandler>()
+
+    // Gets the final statistics of a ping session once it ends
+    private val sessionEnds = ConcurrentHashMap<Int, (PingStatistics) -> Unit>()
 
     private val callbackId = AtomicInteger(0)
 
-    private fun addCallback(callback: suspend (ProbeResult) -> Unit): Int {
+    private val closed = AtomicBoolean(false)
+
+    // Addresses reported in results, indexed by target id
+    private val targets = ConcurrentHashMap<Int, String>()
+
+    // Bumped whenever the native queue runs empty
+    private val idleSignals = MutableStateFlow(0)
+
+    private fun addCallback(callback: ProbeHandler): Int {
         val id = callbackId.getAndIncrement()
         callbacks[id] = callback
         return id
     }
 
+    @Suppress("LongParameterList")
+    private fun wrapCallback(
+        type: ProbeType, port: Int, sequence: Int, ttl: Int, timeoutUsec: Long,
+        detectMtu: Boolean, pattern: Int, target: Int, callback: suspend (ProbeResult) -> Unit
+    ): ProbeHandler =
+        if (detectMtu) {
+            { _, result ->
+                if (result is ProbeResult.NetError && result.errNo == EMSGSIZE) {
+                    scope.launch {
+                        sendProbe(
+                            type,
+                            port,
+                            sequence,
+                            ttl,
+                            timeoutUsec,
+                            result.errInfo - result.overhead,
+                            detectMtu,
+                            pattern,
+                            target,
+                            callback
+                        )
+                    }
+                    Unit
+                } else callback.invoke(result)
+            }
+        } else {
+            { _, result -> callback.invoke(result) }
+        }
+
+    /**
+     * Copies a payload pattern to the native side once, so probes can refer to it by id.
+     *
+     * @param pattern Bytes repeated over the probe payload. An empty pattern fills it with zeros.
+     * @return The pattern id to pass to [sendProbe] and [sendProbes].
+     */
+    fun registerPattern(pattern: ByteArray): Int {
+        val id = registerPattern(instance, pattern)
+        check(id >= 0) { "Too many patterns registered" }
+        return id
+    }
+
+    /**
+     * Adds a destination to probe through this manager's sockets.
+     *
+     * @param host The host address, resolved once here.
+     * @return The target id to pass to [sendProbe], [sendProbes], [startSession] and [startTrace].
+     */
+    fun registerTarget(host: String): Int {
+        val remote = requireNotNull(InetAddress.getByName(host).hostAddress)
+        val id = registerTarget(instance, remote)
+        check(id >= 0) { "Too many targets registered" }
+        targets[id] = remote
+        return id
+    }
+
+    /**
+     * Sends a single probe.
+     *
+     * @param timeoutUsec Probe timeout in microseconds, measured on the monotonic clock.
+     * @param pattern Id returned by [registerPattern], or [NO_PATTERN] for a zero-filled payload.
+     * @param target Id returned by [registerTarget], or [PRIMARY_TARGET] for the host of the manager.
+     */
     @Suppress("LongParameterList")
     fun sendProbe(
-        type: ProbeType, port: Int, sequence: Int, ttl: Int, timeout: Int,
-        size: Int, detectMtu: Boolean, pattern: ByteArray, callback: suspend (ProbeResult) -> Unit
+        type: ProbeType, port: Int, sequence: Int, ttl: Int, timeoutUsec: Long,
+        size: Int, detectMtu: Boolean, pattern: Int, target: Int = PRIMARY_TARGET,
+        callback: suspend (ProbeResult) -> Unit
     ) {
         val callbackId = addCallback(
-            if (detectMtu) {
-                { result ->
-                    if (result is ProbeResult.NetError && result.errNo == EMSGSIZE) {
-                        scope.launch {
-                            sendProbe(
-                                type,
-                                port,
-                                sequence,
-                                ttl,
-                                timeout,
-                                result.errInfo - result.overhead,
-                                detectMtu,
-                                pattern,
-                                callback
-                            )
-                        }
-                        Unit
-                    } else callback.invoke(result)
-                }
-            } else callback)
+            wrapCallback(type, port, sequence, ttl, timeoutUsec, detectMtu, pattern, target, callback)
+        )
         sendProbe(
             instance,
             callbackId,
@@ -77,16 +175,217 @@ internal class ProbeManager(host: String, sourceIp: String = "") : AutoCloseable
             port,
             sequence,
             ttl,
-            timeout,
+            timeoutUsec,
             size,
             detectMtu,
-            pattern
+            pattern,
+            target
         )
     }
 
+    /**
+     * Sends a batch of probes sharing type, timeout and pattern with a single native call.
+     *
+     * All probes of the batch share one [handler], which gets the position of the probe in the arrays.
+     * With [detectMtu] the arrays are kept to resend probes, they must not change afterwards.
+     *
+     * @param timeoutUsec Probe timeout in microseconds, measured on the monotonic clock.
+     * @param pattern Id returned by [registerPattern], or [NO_PATTERN] for a zero-filled payload.
+     * @param targets Ids returned by [registerTarget], one per probe. `null` sends every probe to [PRIMARY_TARGET].
+     * @return The probe ids, in the order of the arrays. Probes failing to send still get the handler invoked.
+     */
+    @Suppress("LongParameterList")
+    fun sendProbes(
+        type: ProbeType, timeoutUsec: Long, detectMtu: Boolean, pattern: Int,
+        ports: IntArray, sequences: IntArray, ttls: IntArray, sizes: IntArray, targets: IntArray? = null,
+        handler: suspend (index: Int, result: ProbeResult) -> Unit
+    ): IntArray {
+        val count = ttls.size
+        val firstId = callbackId.getAndAdd(count)
+        val callback: ProbeHandler = { probeId, result ->
+            val index = probeId - firstId
+            if (detectMtu && result is ProbeResult.NetError && result.errNo == EMSGSIZE) {
+                scope.launch {
+                    sendProbe(
+                        type, ports[index], sequences[index], ttls[index], timeoutUsec,
+                        result.errInfo - result.overhead, detectMtu, pattern, targets?.get(index) ?: PRIMARY_TARGET
+                    ) { handler(index, it) }
+                }
+                Unit
+            } else handler(index, result)
+        }
+        val ids = IntArray(count) { firstId + it }
+        ids.forEach { callbacks[it] = callback }
+        sendProbes(
+            instance, firstId, type.code, ports, sequences, ttls, timeoutUsec, sizes, detectMtu, pattern, targets
+        )
+        return ids
+    }
+
+    /**
+     * Starts a ping session. The native worker sends the probes itself on absolute deadlines of the monotonic
+     * clock, so the cadence does not depend on coroutine dispatch or JNI calls.
+     *
+     * Sequences count up from [sequence]. [callback] gets every result of the session. [waitForCompletion]
+     * returns once a finite session has sent all its probes and their results are delivered.
+     *
+     * @param timeoutUsec Probe timeout in microseconds, measured on the monotonic clock.
+     * @param pattern Id returned by [registerPattern], or [NO_PATTERN] for a zero-filled payload.
+     * @param count Number of probes to send, or [INFINITE_SESSION] to keep sending until [stopSession].
+     * @param intervalUsec Time between two sends in microseconds. With a [window] only the minimum spacing,
+     *   `0` then sends as soon as the window allows.
+     * @param window Probes in flight at most, the next one goes out once an earlier one resolves.
+     *   `0` sends on the interval alone.
+     * @param reportResults If false, results only feed [getSessionStats] and [callback] is never invoked.
+     * @param target Id returned by [registerTarget], or [PRIMARY_TARGET] for the host of the manager.
+     * @param onEnd Gets the final statistics after the last result of the session has been delivered.
+     * @return The session id. A session failing to start still gets the callback invoked.
+     */
+    @Suppress("LongParameterList")
+    fun startSession(
+        type: ProbeType, port: Int, sequence: Int, ttl: Int, timeoutUsec: Long, size: Int, pattern: Int,
+        count: Int, intervalUsec: Long, window: Int = 0, reportResults: Boolean = true, target: Int = PRIMARY_TARGET,
+        onEnd: ((PingStatistics) -> Unit)? = null,
+        callback: suspend (ProbeResult) -> Unit
+    ): Int {
+        val sessionId = callbackId.getAndIncrement()
+        sessions[sessionId] = { _, result -> callback.invoke(result) }
+        onEnd?.let { sessionEnds[sessionId] = it }
+        val status = startSession(
+            instance, sessionId, type.code, port, sequence, ttl, timeoutUsec, size, pattern, count, intervalUsec,
+            window, reportResults, target
+        )
+        // Rejected right away, the native side never reports an end for it
+        if (status != SEND_PROBE_SUCCESS) {
+            sessions.remove(sessionId)
+            sessionEnds.remove(sessionId)
+        }
+        return sessionId
+    }
+
+    /**
+     * Statistics of a running session so far. Once the session ends or is stopped, the final statistics
+     * only go to the `onEnd` handler of [startSession].
+     *
+     * @return `null` for an unknown or ended session.
+     */
+    fun getSessionStats(sessionId: Int): PingStatistics? =
+        getSessionStats(instance, sessionId)?.let { PingStatistics.fromNative(it) }
+
+    /**
+     * Stops sending probes of a session. Results of probes already sent are still delivered, the session is
+     * released after the last of them.
+     */
+    fun stopSession(sessionId: Int) {
+        stopSession(instance, sessionId)
+    }
+
+    /**
+     * Starts a traceroute. The native worker schedules the hops, keeps the concurrency window of
+     * [TraceStrategy.Stepped], repeats the cycles of [TraceStrategy.Concurrent] and picks the ports, so nothing
+     * waits on Kotlin between probes.
+     *
+     * Once a hop gets [ProbeResult.Success] or [ProbeResult.ConnectionRefused], no later hop is probed or
+     * reported anymore, probes to later hops still in flight are cancelled. With [detectMtu] a probe failing
+     * with `EMSGSIZE` is resent at the reported MTU, which also caps the size of later probes, and only the
+     * result of the resend is delivered. [waitForCompletion] returns once a finite trace has sent all its
+     * probes and their results are delivered.
+     *
+     * @param timeoutUsec Probe timeout in microseconds, measured on the monotonic clock.
+     * @param size Size of the first probes.
+     * @param pattern Id returned by [registerPattern], or [NO_PATTERN] for a zero-filled payload.
+     * @param ports Destination ports of UDP probes, ignored for ICMP.
+     * @param target Id returned by [registerTarget], or [PRIMARY_TARGET] for the host of the manager.
+     * @param handler Gets the hop number and the result of every probe.
+     * @return The trace id. A trace failing to start still gets the handler invoked.
+     */
+    @Suppress("LongParameterList")
+    fun startTrace(
+        type: ProbeType, timeoutUsec: Long, size: Int, detectMtu: Boolean, pattern: Int,
+        strategy: TraceStrategy, ports: PortStrategy, target: Int = PRIMARY_TARGET,
+        handler: suspend (hop: Int, result: ProbeResult) -> Unit
+    ): Int {
+        val maxHops = when (strategy) {
+            is TraceStrategy.Stepped -> strategy.maxHops
+            is TraceStrategy.Concurrent -> strategy.maxHops
+        }
+        // Every hop reports under its own id, consecutive from the trace id
+        val hopIds = maxHops.coerceAtLeast(1)
+        val traceId = callbackId.getAndAdd(hopIds)
+        val callback: ProbeHandler = { probeId, result -> handler(probeId - traceId + 1, result) }
+        repeat(hopIds) { sessions[traceId + it] = callback }
+        val portMode = when (ports) {
+            is PortStrategy.Fixed -> PORT_FIXED
+            is PortStrategy.Sequential -> PORT_SEQUENTIAL
+            is PortStrategy.Random -> PORT_RANDOM
+        }
+        val portStart = when (ports) {
+            is PortStrategy.Fixed -> ports.port
+            is PortStrategy.Sequential -> ports.start
+            is PortStrategy.Random -> 0
+        }
+        val portStep = (ports as? PortStrategy.Sequential)?.step ?: 0
+        val random = ports as? PortStrategy.Random
+        val status = when (strategy) {
+            is TraceStrategy.Stepped -> startTrace(
+                instance, traceId, type.code, timeoutUsec, size, detectMtu, pattern, TRACE_STEPPED, maxHops,
+                strategy.probesPerHop, strategy.concurrency.coerceAtLeast(1), 0, 0L,
+                portMode, portStart, portStep, random?.min ?: 0, random?.max ?: 0,
+                random?.exclude?.toIntArray() ?: IntArray(0), target
+            )
+
+            is TraceStrategy.Concurrent -> startTrace(
+                instance, traceId, type.code, timeoutUsec, size, detectMtu, pattern, TRACE_CONCURRENT, maxHops,
+                0, 0, strategy.cycles, strategy.interval * USEC_PER_MSEC,
+                portMode, portStart, portStep, random?.min ?: 0, random?.max ?: 0,
+                random?.exclude?.toIntArray() ?: IntArray(0), target
+            )
+        }
+        if (status != SEND_PROBE_SUCCESS)
+            repeat(hopIds) { sessions.remove(traceId + it) }
+        return traceId
+    }
+
+    /**
+     * Stops probing further hops of a trace. Results of probes already sent are still delivered, the trace is
+     * released after the last of them.
+     */
+    fun stopTrace(traceId: Int) {
+        stopTrace(instance, traceId)
+    }
+
+    /**
+     * Cancels probes in flight without waiting for their timeouts, their sockets and slots are released
+     * right away. Applies to probes submitted before the call, including ones not sent yet.
+     *
+     * @param firstId The first probe id of the range.
+     * @param lastId The last probe id of the range, inclusive.
+     * @param minTtl Only probes sent with at least this TTL, `0` for any.
+     *
+     * The callbacks of cancelled probes are never invoked, they are dropped once the probes are released.
+     */
+    fun cancelProbes(firstId: Int, lastId: Int = firstId, minTtl: Int = 0) {
+        cancel(instance, firstId, lastId, minTtl, false)
+    }
+
+    /**
+     * Stops a ping session or trace and cancels all its probes in flight, see [cancelProbes].
+     */
+    fun cancelSession(sessionId: Int) {
+        cancel(instance, sessionId, sessionId, 0, true)
+    }
+
+    /**
+     * Suspends until every probe, session and trace submitted so far has been reported. The native side
+     * signals when its queue runs empty, so this returns as soon as the last callback has run.
+     */
     suspend fun waitForCompletion() {
-        while (getQueueSize(instance) > 0) {
-            delay(WAIT_RESOLUTION)
+        while (true) {
+            // Read before the queue size, a signal in between is not missed
+            val seen = idleSignals.value
+            if (getQueueSize(instance) <= 0)
+                return
+            idleSignals.first { it != seen }
         }
     }
 
@@ -94,42 +393,163 @@ internal class ProbeManager(host: String, sourceIp: String = "") : AutoCloseable
         return getQueueSize(instance)
     }
 
+    /**
+     * Number of results discarded under [Backpressure.DROP].
+     */
+    fun getDroppedCount(): Long {
+        return getDroppedCount(instance)
+    }
+
+    private fun findCallback(probeId: Int): ProbeHandler? = callbacks.remove(probeId) ?: sessions[probeId]
+
     @Suppress("unused")
     fun probeCallback(probeId: Int, probeResult: ProbeResult) {
-        callbacks[probeId]?.also {
+        findCallback(probeId)?.also {
             runBlocking(scope.coroutineContext) {
-                it(probeResult)
+                it(probeId, probeResult)
             }
-            callbacks.remove(probeId)
         }
     }
 
+    @Suppress("unused")
+    fun resultsCallback(from: Int, to: Int) {
+        val ring = resultRing ?: return
+        ring.forEach(from, to) { probeId, record ->
+            findCallback(probeId)?.also {
+                runBlocking(scope.coroutineContext) {
+                    it(probeId, ring.decode(record))
+                }
+            }
+        }
+    }
+
+    // Cancelled or dropped under Backpressure.DROP, the callbacks are never invoked
+    @Suppress("unused")
+    fun releasedCallback(probeIds: IntArray) {
+        probeIds.forEach { callbacks.remove(it) }
+    }
+
+    @Suppress("unused")
+    fun sessionEndCallback(id: Int, span: Int, stats: LongArray?) {
+        repeat(span) { sessions.remove(id + it) }
+        val onEnd = sessionEnds.remove(id)
+        if (stats != null)
+            onEnd?.invoke(PingStatistics.fromNative(stats))
+    }
+
+    @Suppress("unused")
+    fun idleCallback() {
+        idleSignals.update { it + 1 }
+    }
+
     init {
         val address = InetAddress.getByName(host)
-        instance = create(requireNotNull(address.hostAddress), sourceIp)
+        val remote = requireNotNull(address.hostAddress)
+        targets[PRIMARY_TARGET] = remote
+        instance = create(
+            remote, sourceIp, sharedSockets, kernelTimestamps, resultRing, backpressure.code,
+            payloadMode.code, payloadMode.limit
+        )
+        check(instance != 0L) { "Failed to start native probe manager" }
+        this.resultRing = getResultBuffer(instance)?.let { ring -> ResultRing(ring) { targets[it] ?: remote } }
     }
 
+    /**
+     * Releases the native manager. May be called from a probe callback, the native side then
+     * frees it once the callback returns.
+     */
     override fun close() {
-        delete(instance)
+        if (closed.compareAndSet(false, true))
+            delete(instance)
     }
 
+    @Suppress("LongParameterList", "unused")
+    private external fun create(
+        remoteIp: String, sourceIp: String, sharedSockets: Boolean, kernelTimestamps: Boolean, resultRing: Boolean,
+        backpressure: Int, payloadMode: Int, payloadLimit: Int
+    ): Long
+
     @Suppress("unused")
-    private external fun create(remoteIp: String, sourceIp: String): Long
+    private external fun getResultBuffer(ptr: Long): ByteBuffer?
 
     @Suppress("unused")
     private external fun delete(ptr: Long)
 
+    @Suppress("unused")
+    private external fun registerPattern(ptr: Long, pattern: ByteArray): Int
+
+    @Suppress("unused")
+    private external fun registerTarget(ptr: Long, ip: String): Int
+
     @Suppress("unused")
     private external fun getQueueSize(ptr: Long): Int
 
+    @Suppress("unused")
+    private external fun getDroppedCount(ptr: Long): Long
+
+    @Suppress("LongParameterList", "unused")
+    private external fun sendProbes(
+        ptr: Long, firstId: Int, type: Int, ports: IntArray, sequences: IntArray, ttls: IntArray,
+        timeoutUsec: Long, sizes: IntArray, detectMtu: Boolean, pattern: Int, targets: IntArray?
+    ): Int
+
+    @Suppress("LongParameterList", "unused")
+    private external fun startSession(
+        ptr: Long, id: Int, type: Int, port: Int, sequence: Int, ttl: Int, timeoutUsec: Long, size: Int,
+        pattern: Int, count: Int, intervalUsec: Long, window: Int, reportResults: Boolean, target: Int
+    ): Int
+
+    @Suppress("unused")
+    private external fun getSessionStats(ptr: Long, id: Int): LongArray?
+
+    @Suppress("unused")
+    private external fun stopSession(ptr: Long, id: Int): Int
+
+    @Suppress("LongParameterList", "unused")
+    private external fun startTrace(
+        ptr: Long, id: Int, type: Int, timeoutUsec: Long, size: Int, detectMtu: Boolean, pattern: Int,
+        mode: Int, maxHops: Int, probesPerHop: Int, concurrency: Int, cycles: Int, intervalUsec: Long,
+        portMode: Int, portStart: Int, portStep: Int, portMin: Int, portMax: Int, portExclude: IntArray,
+        target: Int
+    ): Int
+
+    @Suppress("unused")
+    private external fun stopTrace(ptr: Long, id: Int): Int
+
+    @Suppress("LongParameterList", "unused")
+    private external fun cancel(ptr: Long, firstId: Int, lastId: Int, minTtl: Int, stop: Boolean): Int
+
     @Suppress("LongParameterList", "unused")
     private external fun sendProbe(
         ptr: Long, id: Int, type: Int, port: Int, sequence: Int, ttl: Int,
-        timeout: Int, size: Int, detectMtu: Boolean, pattern: ByteArray
+        timeoutUsec: Long, size: Int, detectMtu: Boolean, pattern: Int, target: Int
     ): Int
 
     companion object {
-        const val WAIT_RESOLUTION = 100L
+        const val USEC_PER_MSEC = 1000L
+
+        /**
+         * Pattern id registered by every manager, fills payloads with zeros.
+         */
+        const val NO_PATTERN = 0
+
+        /**
+         * Target id of the host the manager was created for.
+         */
+        const val PRIMARY_TARGET = 0
+
+        /**
+         * Session probe count that keeps the session going until it is stopped.
+         */
+        const val INFINITE_SESSION = -1
+
+        // TraceMode and PortMode of the native side
+        private const val SEND_PROBE_SUCCESS = 0
+        private const val TRACE_STEPPED = 0
+        private const val TRACE_CONCURRENT = 1
+        private const val PORT_FIXED = 0
+        private const val PORT_SEQUENTIAL = 1
+        private const val PORT_RANDOM = 2
 
         init {
             loadLibrary("icmpenguin")
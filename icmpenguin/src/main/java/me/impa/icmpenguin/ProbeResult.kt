@@ -32,7 +32,9 @@ sealed interface ProbeResult {
      * @property overhead The overhead of the probe packet.
      * @property elapsedUsec The time elapsed for the probe in microseconds.
      * @property ttl The Time To Live value from the received packet.
-     * @property data The data payload received in the reply.
+     * @property data The data payload received in the reply, limited by the manager's [PayloadMode].
+     * @property dataSize The size of the whole reply, even when [data] holds less of it.
+     * @property dataCrc The CRC32 of the echoed payload with [PayloadMode.Checksum], `-1` otherwise.
      */
     data class Success(
         override val sequence: Int,
@@ -40,7 +42,9 @@ sealed interface ProbeResult {
         override val probeSize: Int,
         override val overhead: Int,
         val elapsedUsec: Int,
-        val ttl: Int, val data: ByteArray
+        val ttl: Int, val data: ByteArray,
+        val dataSize: Int = data.size,
+        val dataCrc: Long = -1L
     ) : ProbeResult {
         override fun equals(other: Any?): Boolean {
             if (this === other) return true
@@ -53,6 +57,8 @@ sealed interface ProbeResult {
             if (ttl != other.ttl) return false
             if (remote != other.remote) return false
             if (!data.contentEquals(other.data)) return false
+            if (dataSize != other.dataSize) return false
+            if (dataCrc != other.dataCrc) return false
             if (probeSize != other.probeSize) return false
             if (overhead != other.overhead) return false
 
@@ -65,6 +71,8 @@ sealed interface ProbeResult {
             result = 31 * result + ttl
             result = 31 * result + remote.hashCode()
             result = 31 * result + data.contentHashCode()
+            result = 31 * result + dataSize
+            result = 31 * result + dataCrc.hashCode()
             result = 31 * result + probeSize
             result = 31 * result + overhead
             return result
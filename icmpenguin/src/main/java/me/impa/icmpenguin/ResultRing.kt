@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+package me.impa.icmpenguin
+
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Reader of the result records the native worker writes into a shared direct buffer.
+ *
+ * Records are only touched during a [ProbeManager.resultsCallback] upcall. A record is turned
+ * into a [ProbeResult] by [decode] only when somebody still waits for it. The layout mirrors
+ * `ResultRecord` in `ResultRing.h`.
+ *
+ * @param buffer Direct buffer over the native ring.
+ * @param targets Maps the target id of a record to the address results report.
+ */
+internal class ResultRing(buffer: ByteBuffer, private val targets: (Int) -> String) {
+
+    private val buffer = buffer.order(ByteOrder.nativeOrder())
+
+    private val capacity = buffer.capacity()
+
+    /**
+     * Walks the records between two ring positions, skipping padding.
+     *
+     * @param action Invoked with the probe id and the record position.
+     */
+    fun forEach(from: Int, to: Int, action: (probeId: Int, record: Int) -> Unit) {
+        var pos = from
+        while (pos != to) {
+            if (kind(pos) != KIND_PADDING)
+                action(int(pos, ID), pos)
+            pos = (pos + int(pos, LENGTH)) % capacity
+        }
+    }
+
+    private fun int(record: Int, field: Int): Int = buffer.getInt(record + field)
+
+    private fun kind(record: Int): Int = int(record, KIND)
+
+    private fun offender(record: Int): String {
+        val start = record + OFFENDER
+        var end = start
+        while (end < start + OFFENDER_SIZE && buffer.get(end) != 0.toByte())
+            end++
+        return String(bytes(start, end - start), Charsets.US_ASCII)
+    }
+
+    private fun payload(record: Int): ByteArray = bytes(record + HEADER_SIZE, int(record, PAYLOAD_LEN))
+
+    private fun bytes(offset: Int, length: Int): ByteArray =
+        ByteArray(length).also { buffer.duplicate().apply { position(offset) }.get(it) }
+
+    /**
+     * Builds the result of the record at [record].
+     */
+    fun decode(record: Int): ProbeResult {
+        val sequence = int(record, SEQUENCE)
+        val probeSize = int(record, PROBE_SIZE)
+        val overhead = int(record, OVERHEAD)
+        val elapsedUsec = int(record, ELAPSED_USEC)
+        val remote = targets(int(record, TARGET))
+        return when (kind(record)) {
+            KIND_SUCCESS -> ProbeResult.Success(
+                sequence, remote, probeSize, overhead, elapsedUsec, int(record, TTL), payload(record),
+                int(record, REPLY_SIZE), buffer.getLong(record + REPLY_CRC)
+            )
+            KIND_TIMEOUT -> ProbeResult.Timeout(sequence, remote, probeSize, overhead)
+            KIND_CONNECTION_REFUSED -> ProbeResult.ConnectionRefused(
+                sequence, remote, probeSize, overhead, offender(record), elapsedUsec
+            )
+            KIND_HOST_UNREACHABLE -> ProbeResult.HostUnreachable(
+                sequence, remote, probeSize, overhead, offender(record), elapsedUsec
+            )
+            KIND_NET_UNREACHABLE -> ProbeResult.NetUnreachable(
+                sequence, remote, probeSize, overhead, offender(record), elapsedUsec
+            )
+            KIND_NET_ERROR -> ProbeResult.NetError(
+                sequence, remote, probeSize, overhead, offender(record),
+                int(record, ERR_NO), int(record, ERR_CODE), int(record, ERR_TYPE), int(record, ERR_INFO)
+            )
+            else -> ProbeResult.Unknown(
+                sequence, remote, probeSize, overhead, String(payload(record), Charsets.UTF_8)
+            )
+        }
+    }
+
+    private companion object {
+        const val KIND_PADDING = -1
+        const val KIND_SUCCESS = 0
+        const val KIND_TIMEOUT = 1
+        const val KIND_CONNECTION_REFUSED = 2
+        const val KIND_HOST_UNREACHABLE = 3
+        const val KIND_NET_UNREACHABLE = 4
+        const val KIND_NET_ERROR = 5
+
+        // Field offsets of ResultRecord
+        const val LENGTH = 0
+        const val KIND = 4
+        const val ID = 8
+        const val TARGET = 12
+        const val SEQUENCE = 16
+        const val PROBE_SIZE = 20
+        const val OVERHEAD = 24
+        const val ELAPSED_USEC = 28
+        const val TTL = 32
+        const val ERR_NO = 36
+        const val ERR_CODE = 40
+        const val ERR_TYPE = 44
+        const val ERR_INFO = 48
+        const val PAYLOAD_LEN = 52
+        const val REPLY_SIZE = 56
+        const val REPLY_CRC = 64
+        const val OFFENDER = 72
+        const val OFFENDER_SIZE = 48
+        const val HEADER_SIZE = 120
+    }
+}
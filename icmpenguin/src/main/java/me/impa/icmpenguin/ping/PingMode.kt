@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+package me.impa.icmpenguin.ping
+
+/**
+ * How [Pinger] paces its echo requests.
+ */
+sealed class PingMode {
+    /**
+     * One request every [Pinger.interval] milliseconds, no matter when replies arrive.
+     */
+    data object Interval : PingMode()
+
+    /**
+     * Like `ping -A`: the next request goes out as soon as the previous one is answered or times out,
+     * but no sooner than [minIntervalUsec] after it.
+     */
+    data class Adaptive(val minIntervalUsec: Long = 0) : PingMode() {
+        init {
+            require(minIntervalUsec >= 0) { "Interval must not be negative" }
+        }
+    }
+
+    /**
+     * Like `ping -f`: keeps up to [window] requests in flight and sends a new one whenever an earlier one
+     * resolves, at most one per [minIntervalUsec]. Runs at the highest rate the path sustains, meant for
+     * saturation checks with [Pinger.measure].
+     */
+    data class Flood(val window: Int = DEFAULT_WINDOW, val minIntervalUsec: Long = 0) : PingMode() {
+        init {
+            require(window > 0) { "Window must be positive" }
+            require(minIntervalUsec >= 0) { "Interval must not be negative" }
+        }
+
+        companion object {
+            const val DEFAULT_WINDOW = 16
+        }
+    }
+}
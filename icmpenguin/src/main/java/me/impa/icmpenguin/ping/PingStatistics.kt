@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2025 Alexander Yaburov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+package me.impa.icmpenguin.ping
+
+/**
+ * Statistics of a ping session, counted by the native worker as probes resolve.
+ *
+ * Round-trip percentiles come from a log-linear histogram and are accurate to about 6%.
+ *
+ * @property sent Echo requests sent.
+ * @property received Echo replies received.
+ * @property lost Requests that timed out.
+ * @property errors Requests answered with an ICMP error or failing to send.
+ * @property durationUsec Time from the first request to the last one, or to now while the session runs.
+ * @property rttMinUsec The shortest round-trip time in microseconds.
+ * @property rttAvgUsec The mean round-trip time in microseconds.
+ * @property rttMaxUsec The longest round-trip time in microseconds.
+ * @property rttP50Usec The median round-trip time in microseconds.
+ * @property rttP90Usec The 90th percentile of round-trip times in microseconds.
+ * @property rttP99Usec The 99th percentile of round-trip times in microseconds.
+ */
+data class PingStatistics(
+    val sent: Long = 0,
+    val received: Long = 0,
+    val lost: Long = 0,
+    val errors: Long = 0,
+    val durationUsec: Long = 0,
+    val rttMinUsec: Long = 0,
+    val rttAvgUsec: Long = 0,
+    val rttMaxUsec: Long = 0,
+    val rttP50Usec: Long = 0,
+    val rttP90Usec: Long = 0,
+    val rttP99Usec: Long = 0
+) {
+    /**
+     * Share of resolved requests left without a reply, from `0.0` to `1.0`.
+     */
+    val loss: Double
+        get() {
+            val resolved = received + lost + errors
+            return if (resolved > 0) (lost + errors).toDouble() / resolved else 0.0
+        }
+
+    /**
+     * Requests sent per second.
+     */
+    val rate: Double
+        get() = if (durationUsec > 0) sent * USEC_PER_SEC / durationUsec else 0.0
+
+    internal companion object {
+        const val USEC_PER_SEC = 1_000_000.0
+
+        /**
+         * Builds statistics from the values returned by the native side, in declaration order.
+         */
+        fun fromNative(values: LongArray) = PingStatistics(
+            values[0], values[1], values[2], values[3], values[4], values[5],
+            values[6], values[7], values[8], values[9], values[10]
+        )
+    }
+}
@@ -18,11 +18,14 @@
 package me.impa.icmpenguin.ping
 
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.delay
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
+import me.impa.icmpenguin.Backpressure
+import me.impa.icmpenguin.PayloadMode
 import me.impa.icmpenguin.ProbeManager
 import me.impa.icmpenguin.ProbeResult
 import me.impa.icmpenguin.ProbeType
@@ -54,6 +57,16 @@ import java.util.concurrent.atomic.AtomicBoolean
  * @property probeSize The size of the ICMP packet's data payload in bytes.
  * @property pattern An optional byte array to use as the data payload. If null, a zero-filled byte array of `probeSize` will be used.
  * @property sourceIp The source IP address to use for sending packets. If empty, the system will choose automatically.
+ * @property timeoutUsec Timeout in microseconds for each ping request, derived from [timeout] by default.
+ * Allows sub-millisecond timeouts for low-latency networks.
+ * @property payloadMode How much of each echo reply is delivered in [ProbeResult.Success.data].
+ * Use [PayloadMode.None] when only round-trip times matter, large probes are then not copied around.
+ * @property mode How requests are paced. [interval] only applies to [PingMode.Interval].
+ * @property sharedSockets If true, requests share one long-lived socket instead of opening one per request.
+ * @property kernelTimestamps If true, round-trip times are taken from kernel TX/RX timestamps where available.
+ * @property resultRing If true, results are passed from the native side in batches through a shared buffer.
+ * Worth it for [PingMode.Flood] with results reported.
+ * @property backpressure What happens when [ping] callbacks fall behind the replies.
  */
 @Suppress("LongParameterList")
 class Pinger(
@@ -64,7 +77,14 @@ class Pinger(
     val interval: Int = DEFAULT_INTERVAL,
     val probeSize: Int = DEFAULT_PROBE_SIZE,
     val pattern: ByteArray? = null,
-    val sourceIp: String = ""
+    val sourceIp: String = "",
+    val timeoutUsec: Long = timeout * 1000L,
+    val payloadMode: PayloadMode = PayloadMode.Full,
+    val mode: PingMode = PingMode.Interval,
+    val sharedSockets: Boolean = true,
+    val kernelTimestamps: Boolean = true,
+    val resultRing: Boolean = false,
+    val backpressure: Backpressure = Backpressure.BLOCK
 ) {
 
     private val _isActive = AtomicBoolean(false)
@@ -85,30 +105,91 @@ class Pinger(
      * @param callback A lambda function that will be invoked with the [ProbeResult] for each ping attempt.
      */
     suspend fun ping(callback: (ProbeResult) -> Unit) {
+        runSession(true, callback, null) { manager, _ ->
+            manager.waitForCompletion()
+        }
+    }
+
+    /**
+     * Runs a ping session for its statistics alone, individual results are never delivered.
+     *
+     * Together with [PingMode.Flood] this checks how much echo traffic the path sustains. Results are only
+     * counted natively, so the rate is not limited by callbacks.
+     *
+     * If the ping process is already active, this function returns empty statistics right away.
+     *
+     * @param reportInterval How often [onStatistics] gets the live statistics, in milliseconds.
+     * @param onStatistics Invoked with the statistics so far while the session runs.
+     * @return The statistics of the whole session.
+     */
+    suspend fun measure(
+        reportInterval: Long = DEFAULT_REPORT_INTERVAL,
+        onStatistics: (PingStatistics) -> Unit = {}
+    ): PingStatistics {
+        var statistics = PingStatistics()
+        // Handed over after the last result, before waitForCompletion returns
+        runSession(false, {}, { statistics = it }) { manager, session ->
+            coroutineScope {
+                val reporter = launch {
+                    while (true) {
+                        delay(reportInterval)
+                        manager.getSessionStats(session)?.let(onStatistics)
+                    }
+                }
+                try {
+                    manager.waitForCompletion()
+                } finally {
+                    reporter.cancel()
+                }
+            }
+        }
+        return statistics
+    }
+
+    private suspend fun runSession(
+        reportResults: Boolean,
+        callback: (ProbeResult) -> Unit,
+        onEnd: ((PingStatistics) -> Unit)?,
+        block: suspend (manager: ProbeManager, session: Int) -> Unit
+    ) {
         if (_isActive.get())
             return
         _isActive.set(true)
         try {
             withContext(Dispatchers.IO) {
                 val address = InetAddress.getByName(host)
-                ProbeManager(requireNotNull(address.hostAddress), sourceIp).use { manager ->
-                    var pingCount = 0
-                    while (_isActive.get() && (pingCount++ < maxPingCount || maxPingCount == INFINITE)) {
-                        launch {
-                            manager.sendProbe(
-                                ProbeType.ICMP,
-                                0,
-                                pingCount,
-                                ttl,
-                                timeout,
-                                probeSize,
-                                false,
-                                pattern ?: ByteArray(probeSize)
-                            ) { callback(it) }
-                        }.join()
-                        delay(interval.toLong())
+                ProbeManager(
+                    requireNotNull(address.hostAddress), sourceIp, sharedSockets, kernelTimestamps, resultRing,
+                    backpressure, payloadMode
+                ).use { manager ->
+                    if (maxPingCount <= 0 && maxPingCount != INFINITE)
+                        return@use
+                    val patternId = pattern?.let { manager.registerPattern(it) } ?: ProbeManager.NO_PATTERN
+                    val (intervalUsec, window) = when (mode) {
+                        PingMode.Interval -> interval.coerceAtLeast(1) * ProbeManager.USEC_PER_MSEC to 0
+                        is PingMode.Adaptive -> mode.minIntervalUsec to 1
+                        is PingMode.Flood -> mode.minIntervalUsec to mode.window
+                    }
+                    // The native worker keeps the pace, the first probe goes out right away
+                    val session = manager.startSession(
+                        ProbeType.ICMP,
+                        0,
+                        1,
+                        ttl,
+                        timeoutUsec,
+                        probeSize,
+                        patternId,
+                        if (maxPingCount == INFINITE) ProbeManager.INFINITE_SESSION else maxPingCount,
+                        intervalUsec,
+                        window,
+                        reportResults,
+                        onEnd = onEnd
+                    ) { callback(it) }
+                    try {
+                        block(manager, session)
+                    } finally {
+                        manager.stopSession(session)
                     }
-                    manager.waitForCompletion()
                 }
             }
         } finally {
@@ -151,5 +232,6 @@ class Pinger(
         const val DEFAULT_INTERVAL = 1000
         const val DEFAULT_PING_COUNT = 4
         const val DEFAULT_TTL = -1
+        const val DEFAULT_REPORT_INTERVAL = 1000L
     }
 }
\ No newline at end of file
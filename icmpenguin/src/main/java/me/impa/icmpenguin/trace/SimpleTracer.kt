@@ -21,6 +21,7 @@ import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.sync.Semaphore
 import kotlinx.coroutines.sync.withPermit
+import me.impa.icmpenguin.PayloadMode
 import me.impa.icmpenguin.ProbeResult
 import me.impa.icmpenguin.ProbeType
 
@@ -88,7 +89,9 @@ class SimpleTracer(
             timeout = timeout,
             probeSize = probeSize,
             portStrategy = portStrategy,
-            sourceIp = sourceIp
+            sourceIp = sourceIp,
+            // Hop statuses never look at reply data
+            payloadMode = PayloadMode.None
         )
         tracer.trace { hop, result ->
             semaphore.withPermit {
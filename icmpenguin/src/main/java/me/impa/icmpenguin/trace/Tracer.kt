@@ -19,18 +19,16 @@ package me.impa.icmpenguin.trace
 
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.coroutineScope
-import kotlinx.coroutines.delay
-import kotlinx.coroutines.ensureActive
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.channelFlow
 import kotlinx.coroutines.withContext
+import me.impa.icmpenguin.Backpressure
+import me.impa.icmpenguin.PayloadMode
 import me.impa.icmpenguin.ProbeManager
 import me.impa.icmpenguin.ProbeResult
 import me.impa.icmpenguin.ProbeType
 import java.net.InetAddress
 import java.util.concurrent.atomic.AtomicBoolean
-import java.util.concurrent.atomic.AtomicInteger
-import kotlin.math.min
 
 /**
  * Class for performing traceroute operations.
@@ -48,7 +46,15 @@ import kotlin.math.min
  * @property timeout The timeout for each probe in milliseconds. Defaults to [DEFAULT_TIMEOUT].
  *   The value will be coerced to be within [MIN_TIME_OUT] and [MAX_TIME_OUT].
  * @property sourceIp The source IP address to bind to. If empty, a source address will be chosen automatically.
+ * @property payloadMode How much of each echo reply is delivered in [ProbeResult.Success.data].
+ *   Defaults to [PayloadMode.Full].
+ * @property sharedSockets If true, ICMP probes share one long-lived socket instead of opening one per probe.
+ *   UDP probes always use their own socket.
+ * @property kernelTimestamps If true, round-trip times are taken from kernel TX/RX timestamps where available.
+ * @property resultRing If true, results are passed from the native side in batches through a shared buffer.
+ * @property backpressure What happens when callbacks fall behind the replies.
  */
+@Suppress("LongParameterList")
 class Tracer(
     val host: String,
     val probeType: ProbeType,
@@ -56,105 +62,35 @@ class Tracer(
     val portStrategy: PortStrategy = PortStrategy.Sequential(),
     val probeSize: ProbeSize = ProbeSize.Static(size = DEFAULT_PROBE_SIZE),
     val timeout: Int = DEFAULT_TIMEOUT,
-    val sourceIp: String = ""
+    val sourceIp: String = "",
+    val payloadMode: PayloadMode = PayloadMode.Full,
+    val sharedSockets: Boolean = true,
+    val kernelTimestamps: Boolean = true,
+    val resultRing: Boolean = false,
+    val backpressure: Backpressure = Backpressure.BLOCK
 ) {
 
-    private var cutoff = AtomicInteger(Int.MAX_VALUE)
     private val _isActive = AtomicBoolean(false)
 
-    @Suppress("LongParameterList")
-    private suspend fun concurrentTrace(
-        ip: String,
-        hops: Int,
-        cycles: Int,
-        interval: Long,
-        portStrategy: PortStrategy?,
-        probeSize: ProbeSize,
-        callback: suspend (Int, ProbeResult) -> Unit
-    ) {
-        var cycle = 0
-        val size = AtomicInteger(if (probeSize is ProbeSize.Static) probeSize.size else MAX_PACKET_SIZE)
-        coroutineScope {
-            ProbeManager(ip, sourceIp).use { manager ->
-                while (_isActive.get() && (cycles == TraceStrategy.Concurrent.INFINITE || cycle < cycles)) {
-                    for (hop in 1..hops) {
-                        manager.sendProbe(
-                            probeType,
-                            portStrategy?.resolve(hop) ?: 0,
-                            cycle,
-                            hop,
-                            timeout,
-                            size.get(),
-                            probeSize is ProbeSize.MtuDiscovery,
-                            ByteArray(0)
-                        ) {
-                            if (it is ProbeResult.Success || it is ProbeResult.ConnectionRefused) {
-                                cutoff.set(min(hop, cutoff.get()))
-                            }
-                            if (probeSize is ProbeSize.MtuDiscovery) {
-                                size.getAndUpdate { old -> if (old > it.probeSize) it.probeSize else old }
-                            }
-                            if (hop <= cutoff.get())
-                                callback(hop, it)
-                        }
-                    }
-                    cycle++
-                    delay(interval)
-                }
-            }
-        }
-    }
-
-    @Suppress("LongParameterList", "LoopWithTooManyJumpStatements")
-    private suspend fun steppedTrace(
-        ip: String,
-        probesPerHop: Int,
-        hops: Int,
-        concurrency: Int,
-        portStrategy: PortStrategy?,
-        probeSize: ProbeSize,
-        callback: suspend (Int, ProbeResult) -> Unit
-    ) {
-        val probeCounter = AtomicInteger(0)
-        val maxConcurrentProbes = concurrency.coerceAtLeast(1)
-        val size = AtomicInteger(if (probeSize is ProbeSize.Static) probeSize.size else MAX_PACKET_SIZE)
-
-        coroutineScope {
-            ProbeManager(ip, sourceIp).use { manager ->
-                while (_isActive.get()) {
-                    if (manager.getQueueSize() > maxConcurrentProbes) {
-                        delay(WAIT_RESOLUTION)
-                        continue
-                    }
-                    val currentProbe = probeCounter.getAndIncrement()
-                    val currentHop = currentProbe / probesPerHop + 1
-                    if (currentHop > min(hops, cutoff.get()))
-                        break
-                    val port = portStrategy?.resolve(currentHop) ?: 0
-                    withContext(Dispatchers.IO) {
-                        manager.sendProbe(
-                            probeType,
-                            port,
-                            currentProbe,
-                            currentHop,
-                            timeout,
-                            size.get(),
-                            probeSize is ProbeSize.MtuDiscovery,
-                            ByteArray(0)
-                        ) {
-                            if (it is ProbeResult.Success || it is ProbeResult.ConnectionRefused) {
-                                cutoff.set(min(currentHop, cutoff.get()))
-                            }
-                            if (probeSize is ProbeSize.MtuDiscovery) {
-                                size.getAndUpdate { old -> if (old > it.probeSize) it.probeSize else old }
-                            }
-                            if (currentHop <= cutoff.get())
-                                callback(currentHop, it)
-                        }
-                    }
-                }
-                ensureActive()
+    private suspend fun runTrace(ip: String, callback: suspend (Int, ProbeResult) -> Unit) {
+        ProbeManager(
+            ip, sourceIp, sharedSockets, kernelTimestamps, resultRing, backpressure, payloadMode
+        ).use { manager ->
+            // The native worker walks the hops on its own, only results come back
+            val traceId = manager.startTrace(
+                probeType,
+                timeout * ProbeManager.USEC_PER_MSEC,
+                if (probeSize is ProbeSize.Static) probeSize.size else MAX_PACKET_SIZE,
+                probeSize is ProbeSize.MtuDiscovery,
+                ProbeManager.NO_PATTERN,
+                traceStrategy,
+                portStrategy,
+                handler = callback
+            )
+            try {
                 manager.waitForCompletion()
+            } finally {
+                manager.stopTrace(traceId)
             }
         }
     }
@@ -181,27 +117,7 @@ class Tracer(
             coroutineScope {
                 withContext(Dispatchers.IO) {
                     val address = InetAddress.getByName(host)
-                    when (traceStrategy) {
-                        is TraceStrategy.Concurrent -> concurrentTrace(
-                            requireNotNull(address.hostAddress),
-                            traceStrategy.maxHops,
-                            traceStrategy.cycles,
-                            traceStrategy.interval,
-                            portStrategy,
-                            probeSize,
-                            callback
-                        )
-
-                        is TraceStrategy.Stepped -> steppedTrace(
-                            requireNotNull(address.hostAddress),
-                            traceStrategy.probesPerHop,
-                            traceStrategy.maxHops,
-                            traceStrategy.concurrency,
-                            portStrategy,
-                            probeSize,
-                            callback
-                        )
-                    }
+                    runTrace(requireNotNull(address.hostAddress), callback)
                 }
             }
         } finally {
@@ -225,7 +141,6 @@ class Tracer(
     }
 
     companion object {
-        private const val WAIT_RESOLUTION = 100L
         private const val MAX_PACKET_SIZE = 65487 // 65535 - 40 (IPv6 IP header) - 8 (UDP header)
         const val DEFAULT_TIMEOUT = 5000
         const val DEFAULT_PROBE_SIZE = 32